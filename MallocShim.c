@@ -0,0 +1,248 @@
+/* MALLOC INTERPOSITION FOR THE BASIC MEMORY MANAGEMENT SYSTEM
+   Serves malloc(), free() and friends for a whole process from M1, for comparing against the system allocator on
+   programs that were never written for Malloc/Free. Build and run with
+
+     gcc -O2 -shared -fPIC -fvisibility=hidden -pthread -o libmmshim.so MallocShim.c
+     LD_PRELOAD=./libmmshim.so some_program
+
+   MM_HEAP_SIZE sets the size of M1 in bytes (1 GB by default; only the pages touched take memory). The shim's own
+   test is built and run with
+
+     gcc -O0 -pthread -DMALLOC_SHIM_TEST -o shimtest MallocShim.c && ./shimtest
+ */
+
+#define _GNU_SOURCE //for the recursive mutex initializer
+#define MEMORY_MANAGER_LIBRARY
+#include "MemoryManager.c"
+
+#include <malloc.h>
+#include <dlfcn.h>
+
+#define SHIM_API __attribute__((visibility("default"))) //everything else in MemoryManager.c stays out of the way of the program's own symbols
+#define SHIM_ALIGNMENT 16 //what malloc() promises on x86-64: alignof(max_align_t)
+#define DEFAULT_SHIM_HEAP ((size_t) 1 << 30)
+
+/* M1 is not thread safe outside a shared heap, so every entry point takes this. Recursive, because backtrace()
+ in the sampling profiler can call malloc() from inside Malloc. */
+static pthread_mutex_t shimLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static int shimReady;
+
+/* The allocator behind the shim, for blocks it handed out that then reach free() or realloc() here */
+static void (*realFree)(void*);
+static void* (*realRealloc)(void*, size_t);
+static size_t (*realUsableSize)(void*);
+
+/* Holding the lock across fork() means the child never starts with M1 half changed by a thread it does not have.
+ The child's thread has a new id, so it cannot unlock a recursive mutex the parent's thread took; it starts afresh. */
+static void shimPrepareFork(void){ pthread_mutex_lock(&shimLock); }
+static void shimParentFork(void){ pthread_mutex_unlock(&shimLock); }
+static void shimChildFork(void){ shimLock = (pthread_mutex_t) PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP; }
+
+/* Maps M1 on the first call. getenv and strtoul do not allocate, so nothing here comes back into malloc(). */
+static int shimInit(void){
+    const char* setting;
+    size_t size = DEFAULT_SHIM_HEAP;
+
+    if (shimReady)
+        return 0;
+    setting = getenv("MM_HEAP_SIZE");
+    if (setting && strtoul(setting, NULL, 0) > 0)
+        size = strtoul(setting, NULL, 0);
+    if (size > 0xfffffff8) //block sizes are kept in 32 bit tags.
+        size = 0xfffffff8;
+    if (InitMapped(size))
+        return -1;
+    SetDeferredCoalescing(1); //most programs free and reallocate the same small sizes over and over.
+    shimReady = 1;
+    pthread_atfork(shimPrepareFork, shimParentFork, shimChildFork);
+    return 0;
+}
+
+/* True for addresses M1 handed out. Anything else came from the allocator behind the shim, through a library that
+ calls it directly or from before the shim was loaded, and goes back to it. */
+static int shimOwns(void* ptr){
+    return shimReady && (addrs_t) ptr >= basePointer && (addrs_t) ptr < basePointer + memSize;
+}
+
+/* Looks up the allocator behind the shim the first time a block of its turns up. Every thread finds the same
+ functions, so a race here is harmless. */
+static void shimFindReal(void){
+    if (realFree)
+        return;
+    realRealloc = (void* (*)(void*, size_t)) dlsym(RTLD_NEXT, "realloc");
+    realUsableSize = (size_t (*)(void*)) dlsym(RTLD_NEXT, "malloc_usable_size");
+    realFree = (void (*)(void*)) dlsym(RTLD_NEXT, "free");
+}
+
+/* Blocks of 16 bytes or more must be 16 byte aligned; smaller ones cannot hold a type that needs it */
+static void* shimAllocate(size_t size, size_t align){
+    void* ptr = NULL;
+
+    if (size == 0)
+        size = 1;
+    pthread_mutex_lock(&shimLock);
+    if (shimInit() == 0){ //Malloc and MallocAligned turn away sizes that cannot fit before they round them.
+        if (align > ALIGNMENT)
+            ptr = MallocAligned(size, align);
+        else if (size >= SHIM_ALIGNMENT)
+            ptr = MallocAligned(size, SHIM_ALIGNMENT);
+        else
+            ptr = Malloc(size);
+    }
+    pthread_mutex_unlock(&shimLock);
+    if (ptr == NULL)
+        errno = ENOMEM;
+    return ptr;
+}
+
+SHIM_API void* malloc(size_t size){
+    return shimAllocate(size, 0);
+}
+
+SHIM_API void free(void* ptr){
+    if (ptr == NULL)
+        return;
+    if (!shimOwns(ptr)){
+        shimFindReal();
+        if (realFree)
+            realFree(ptr);
+        return;
+    }
+    pthread_mutex_lock(&shimLock);
+    Free(ptr);
+    pthread_mutex_unlock(&shimLock);
+}
+
+SHIM_API void* calloc(size_t count, size_t size){
+    void* ptr;
+
+    if (size && count > SIZE_MAX/size){
+        errno = ENOMEM;
+        return NULL;
+    }
+    ptr = shimAllocate(count*size, 0);
+    if (ptr)
+        memset(ptr, 0, count*size); //blocks are reused, so they are not known to be zero.
+    return ptr;
+}
+
+SHIM_API size_t malloc_usable_size(void* ptr){
+    size_t size;
+
+    if (ptr == NULL)
+        return 0;
+    if (!shimOwns(ptr)){
+        shimFindReal();
+        return realUsableSize ? realUsableSize(ptr) : 0;
+    }
+    pthread_mutex_lock(&shimLock);
+    size = blockSize(ptr);
+    pthread_mutex_unlock(&shimLock);
+    return size;
+}
+
+SHIM_API void* realloc(void* ptr, size_t size){
+    /* a block that is already big enough is kept as is. otherwise the data moves to a new block. */
+    size_t oldSize;
+    void* moved;
+
+    if (ptr == NULL)
+        return malloc(size);
+    if (size == 0){
+        free(ptr);
+        return NULL;
+    }
+    if (!shimOwns(ptr)){ //only the allocator that made it knows its size, so it stays there.
+        shimFindReal();
+        if (realRealloc == NULL){
+            fprintf(stderr, "MallocShim: realloc of %p, which M1 did not allocate, and no allocator behind the shim\n", ptr);
+            abort();
+        }
+        return realRealloc(ptr, size);
+    }
+    oldSize = malloc_usable_size(ptr);
+    if (size <= oldSize)
+        return ptr;
+    moved = malloc(size);
+    if (moved == NULL)
+        return NULL;
+    memcpy(moved, ptr, oldSize);
+    free(ptr);
+    return moved;
+}
+
+SHIM_API int posix_memalign(void** result, size_t align, size_t size){
+    if (align < sizeof(void*) || (align & (align - 1)))
+        return EINVAL;
+    *result = shimAllocate(size, align);
+    return *result ? 0 : ENOMEM;
+}
+
+/* The other aligned allocators, so no block the system allocator made ever reaches free() */
+SHIM_API void* aligned_alloc(size_t align, size_t size){
+    if (align == 0 || (align & (align - 1))){
+        errno = EINVAL;
+        return NULL;
+    }
+    return shimAllocate(size, align);
+}
+
+SHIM_API void* memalign(size_t align, size_t size){
+    return aligned_alloc(align, size);
+}
+
+SHIM_API void* valloc(size_t size){
+    return shimAllocate(size, PAGE_SIZE);
+}
+
+
+#ifdef MALLOC_SHIM_TEST
+/* Built as a program with -DMALLOC_SHIM_TEST, the shim is the program's own malloc(). It runs itself again on the
+ biggest M1 there can be, where sizes near 4 GB would wrap in 32 bits if they were not turned away first, and
+ checks that a block from the allocator behind the shim goes back to it. */
+int main(int argc, char **argv){
+    volatile size_t huge = SIZE_MAX; //not a constant, or the compiler warns about the calls that use it.
+    void* ptr = NULL;
+    int err = 0;
+
+    (void) argc;
+    if (!getenv("MM_HEAP_SIZE")){
+        setenv("MM_HEAP_SIZE", "0xfffffff8", 1);
+        execv("/proc/self/exe", argv);
+        return 1;
+    }
+    free(malloc(1)); //maps M1, so memSize is known.
+    printf("Huge requests on a %zu byte M1...\n", memSize);
+    errno = 0;
+    if (malloc(huge) || errno != ENOMEM)
+        err = 1;
+    errno = 0;
+    if (malloc(0xfffffff1) || errno != ENOMEM)
+        err = 1;
+    errno = 0;
+    if (calloc(1, memSize) || errno != ENOMEM)
+        err = 1;
+    errno = 0;
+    if (aligned_alloc(64, huge - 32) || errno != ENOMEM)
+        err = 1;
+    if (posix_memalign(&ptr, 1 << 20, memSize - 4096) != ENOMEM || posix_memalign(&ptr, 64, 0xfffffff0) != ENOMEM)
+        err = 1;
+
+    /* a block from the allocator behind the shim is resized and freed by that allocator */
+    printf("A block the shim did not allocate...\n");
+    ptr = ((void* (*)(size_t)) dlsym(RTLD_NEXT, "malloc"))(100);
+    if (ptr == NULL || shimOwns(ptr))
+        err = 1;
+    else{
+        memset(ptr, 'r', 100);
+        ptr = realloc(ptr, 100000);
+        if (ptr == NULL || ((char*) ptr)[0] != 'r' || ((char*) ptr)[99] != 'r' || malloc_usable_size(ptr) < 100000)
+            err = 1;
+        free(ptr);
+    }
+    if (VerifyHeap())
+        err = 1;
+    printf(err ? "[" KRED "Failed" KRESET "]\n" : "[" KBLU "Passed" KRESET "]\n");
+    return err;
+}
+#endif
@@ -5,21 +5,72 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <execinfo.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 
 /*Variables developed from TF test code in order to evaluate our heap */
 #define ALIGNMENT 8
 #define ALIGNED(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
-#define rdtsc(x)      __asm__ __volatile__("rdtsc \n\t" : "=A" (*(x)))
+#define rdtsc(x)      do { unsigned int lo_, hi_; __asm__ __volatile__("rdtsc \n\t" : "=a" (lo_), "=d" (hi_)); *(x) = ((unsigned long)hi_ << 32) | lo_; } while (0)
 #define DEFAULT_MEM_SIZE 1<<20
 #define ERROR_OUT_OF_MEM    0x1
 #define ERROR_DATA_INCON    0x2
 #define ERROR_ALIGMENT      0x4
 #define ERROR_NOT_FF        0x8
 
+/* Deferred coalescing keeps one quick list per aligned size up to QUICK_LISTS*ALIGNMENT bytes */
+#define QUICK_LISTS 32
+#define QUICK_INDEX(size) (((size) && (size) <= QUICK_LISTS*ALIGNMENT) ? (size)/ALIGNMENT : 0)
+
+/* The free map has one bit per 8 byte granule of M1. Block headers sit 4 bytes past a multiple of 8, so granule g
+ starts at basePointer + 4 + 8*g and a block of aligned size s covers (s + 8)/8 granules. */
+#define MAP_WORDS(size) (((size)/ALIGNMENT + 63)/64)
+#define GRANULE_OF(ptr) ((size_t)((ptr) - basePointer - 4)/ALIGNMENT)
+
+/* Large objects get whole pages from spans that fill M1 from the top down. The page map outside the heap holds
+ the boundary tags of each span, so the objects themselves carry no header or footer. */
+#define PAGE_SIZE 4096
+#define PAGES(size) (((size) + PAGE_SIZE - 1)/PAGE_SIZE)
+#define PAGE_INDEX(ptr) ((size_t)((ptr) - pageBase)/PAGE_SIZE)
+#define DEFAULT_LARGE_THRESHOLD (128*1024)
+
+/* Building with -DHEAP_DEBUG puts a canary after the data of every small block, poisons freed data and checks
+ every Free for double frees and overwritten tags. VerifyHeap() is there in every build. */
+#ifdef HEAP_DEBUG
+#define CANARY_SIZE 8
+#else
+#define CANARY_SIZE 0
+#endif
+#define CANARY_OF(header) (0x5ca1ab1edeadbeefULL ^ (uint64_t)((header) - basePointer)) //by offset, so it holds in every process sharing the heap
+#define POISON_WORD 0xddddddddddddddddULL
+
 #define LOCATION_OF(addr)     ((size_t)addr)
 #define DATA_OF(addr)         (*(addr))
 
+/* The sampling profiler records the stack of about one in every sampleRate bytes Malloc'd. Sampled small blocks
+ have bit 2 set in their header, so Free only looks for a sample when there is one. */
+#define SAMPLED 4
+#define SAMPLE_DEPTH 32 //frames kept per stack
+#define SAMPLE_SITES 1024 //distinct stacks kept
+#define SAMPLE_SLOTS 4096 //sampled blocks that can be live at once, a power of two
+
+#define SHARED_MAGIC 0x4853484d //"MHSH" - shared M1 heap
+#define SHARED_HEADER_SIZE 4096 //the shared header gets its own page so the heap starts page aligned
+
 #define KBLU  "\x1B[34m"
 #define KRED  "\x1B[31m"
 #define KRESET "\x1B[0m"
@@ -28,12 +79,84 @@
 typedef char* addrs_t;
 typedef void* any_t;
 
+/* Header in front of a heap placed in shared memory. The heap itself only holds sizes, so it works at any address. */
+struct sharedHeader {
+    unsigned int magic;
+    size_t memSize; //size of the heap
+    size_t mapOffset; //offset of the free map from the header
+    size_t pageMapOffset; //offset of the page map from the header
+    size_t heapOffset; //offset of the heap from the header
+    size_t curOffset; //end of the allotted memory, relative to the start of the heap
+    size_t spanOffset; //start of the lowest large object span, relative to the start of the heap
+    long int allocatedBlocks; //heapChecker totals for the whole heap, rather than for one process
+    long int freeBlocks;
+    long int rawTotalAllocated;
+    long int paddedTotalAllocated;
+    long int rawFreeBytes;
+    pthread_mutex_t lock; //process-shared, robust and recursive so Put can call Malloc with it held
+    int unusable; //set when a process died holding the lock and left M1 damaged. every call fails from then on
+};
+
+/* A scratch region taken from M1 with a single Malloc. Blocks inside it are bumped off the top with no header
+ or footer, and are only given back all at once with RegionRelease or RegionFree. */
+typedef struct {
+    addrs_t base; //start of the block Malloc'd for the region
+    addrs_t top; //next free byte in the region
+    addrs_t end; //one past the last byte of the region
+} region_t;
+
+/* Allocations sampled from one call stack. The in use totals drop again as the sampled blocks are freed. */
+struct sampleSite {
+    uint64_t hash; //of the stack, 0 while the site is unused
+    int depth;
+    void* stack[SAMPLE_DEPTH];
+    long int inuseObjects;
+    long int inuseBytes;
+    long int allocObjects;
+    long int allocBytes;
+};
+
+/* A sampled block that has not been freed yet */
+struct liveSample {
+    addrs_t addr; //as returned by Malloc, NULL while the slot is empty
+    size_t size; //bytes asked for
+    int site; //index into sampleSites
+};
+
+/* One row of a heap map. DumpHeapMap fills these in with the heap locked and writes them out once it is unlocked. */
+struct mapEntry {
+    size_t offset; //from basePointer
+    size_t size; //bytes taken from M1, header and footer included
+    int state; //index into mapStates
+};
+
 /* prototypes for included functions are below */
 void Init(size_t);
+int InitMapped(size_t);
+int InitShared(const char*, size_t);
+void Close(void);
+size_t OffsetOf(addrs_t);
+addrs_t AddrAt(size_t);
 addrs_t Malloc(size_t);
+addrs_t MallocAligned(size_t, size_t);
 void Free(addrs_t);
+void FreeSized(addrs_t, size_t);
+void SetLargeThreshold(size_t);
+int VerifyHeap(void);
+int DumpHeapMap(FILE*);
+void SetSampleRate(size_t);
+int DumpHeapProfile(FILE*);
+void Sweep(void);
+void SetDeferredCoalescing(int);
 addrs_t Put(any_t, size_t);
+addrs_t PutV(const struct iovec*, int);
+int RegionInit(region_t*, size_t);
+addrs_t RegionMalloc(region_t*, size_t);
+addrs_t RegionMark(region_t*);
+void RegionRelease(region_t*, addrs_t);
+void RegionFree(region_t*);
 void Get(any_t, addrs_t, size_t);
+size_t GetV(const struct iovec*, int, addrs_t);
 void PrintAddrs(void);
 void heapChecker(void);
 int test_stability(int, unsigned long*, unsigned long*);
@@ -41,12 +164,38 @@ int test_ff(void);
 int test_maxNumOfAlloc(void);
 int test_maxSizeOfAlloc(int);
 void print_testResult(int);
+int test_shared(void);
+int test_region(void);
+int test_deferred(int);
+int test_large(void);
+int test_aligned(void);
+int test_verify(void);
+int test_iovec(void);
+int test_heapmap(void);
+int test_profile(void);
+int test_freeScaling(void);
 
 
 
 static addrs_t basePointer; //static starting address of our heap space
 static addrs_t curPointer; //current end address of allotted memory
 static size_t memSize; //static memory size of allocated heap
+static struct sharedHeader* shared; //header of the shared memory object holding the heap, NULL for a private heap
+static int sharedFd = -1; //file descriptor of that shared memory object
+static size_t sharedLength; //bytes mapped for the shared header, free map and heap
+static size_t mappedLength; //bytes mapped by InitMapped for the heap, free map and page map, 0 otherwise
+
+/*static variables needed for the free map */
+static uint64_t* freeMap; //bit g is set when granule g belongs to a free block below curPointer
+static size_t findFreeScalar(const uint64_t*, size_t, size_t);
+static size_t (*findFreeGranule)(const uint64_t*, size_t, size_t) = findFreeScalar; //chosen for the CPU by selectKernels()
+
+/*static variables needed for large objects */
+static size_t largeThreshold = DEFAULT_LARGE_THRESHOLD; //aligned requests of at least this many bytes get their own pages
+static addrs_t pageBase; //first page boundary in M1. entry i of the page map is the page at pageBase + i*PAGE_SIZE
+static size_t pageCount; //number of whole pages in M1 from pageBase
+static unsigned int* pageMap; //first and last page of each span hold its length in pages << 1, | 1 while it is allocated
+static addrs_t spanPointer; //start of the lowest span, or basePointer + memSize when there are none. small blocks stay below it
 
 /*static variables needed for heapChecker */
 static long int mallocCount = 0; //variable to count the number of malloc requests
@@ -59,9 +208,29 @@ static unsigned long tot_alloc_time;
 static unsigned long tot_free_time;
 static long int freeBlocks;
 static long int rawFreeBytes;
+static long int splitCount; //variable to count the free blocks split by Malloc
+static long int mergeCount; //variable to count the blocks merged by Free, including into the end of the heap
 
+/*static variables needed for deferred coalescing */
+static int deferredCoalescing = 0; //set by SetDeferredCoalescing
+static unsigned int quickList[QUICK_LISTS+1]; //offset of the data of the first block on each quick list, 0 if empty. index is size/ALIGNMENT
+static long int quickBlocks; //number of blocks waiting on the quick lists
 
+/*static variables needed for the sampling profiler. samples belong to this process, even when M1 is shared. */
+static long int sampleCountdown = LONG_MAX; //bytes left until the next sample. Malloc only subtracts from it
+static size_t sampleRate; //mean bytes between samples, 0 while the profiler is off
+static uint64_t sampleSeed = 0x9e3779b97f4a7c15ULL; //xorshift state for drawing the intervals
+static int sampling; //set while a stack is taken, so anything backtrace() allocates is not sampled
+static struct sampleSite sampleSites[SAMPLE_SITES];
+static struct liveSample liveSamples[SAMPLE_SLOTS]; //open addressing on the address, linear probing
+static long int liveSampleCount;
+static long int droppedSamples; //samples lost because a table was full
 
+
+
+/* Building with -DMEMORY_MANAGER_LIBRARY leaves out main and the tests, so the file can be built into a library as
+ MallocShim.c does. */
+#ifndef MEMORY_MANAGER_LIBRARY
 int main(int argc, char **argv){
     
     /* a set of tests below that sufficiently test our memory allocating system */
@@ -124,8 +293,49 @@ int main(int argc, char **argv){
      heapChecker();
      */
     
+    /* TEST 5: SHARED MEMORY */
+    printf("\nTest 5: Testing shared memory between processes...\n");
+    print_testResult(test_shared());
+    
+    /* TEST 6: SCOPED REGIONS */
+    printf("\nTest 6: Testing scoped regions...\n");
+    print_testResult(test_region());
+    
+    /* TEST 7: DEFERRED COALESCING */
+    printf("\nTest 7: Comparing eager and deferred coalescing...\n");
+    print_testResult(test_deferred(numIterations));
+    
+    /* TEST 8: LARGE OBJECTS */
+    printf("\nTest 8: Testing large objects...\n");
+    print_testResult(test_large());
+    
+    /* TEST 9: ALIGNED ALLOCATION */
+    printf("\nTest 9: Testing aligned allocations...\n");
+    print_testResult(test_aligned());
+    
+    /* TEST 10: HEAP VERIFIER */
+    printf("\nTest 10: Testing the heap verifier...\n");
+    print_testResult(test_verify());
+    
+    /* TEST 11: SCATTER-GATHER */
+    printf("\nTest 11: Testing Get and scatter-gather copies...\n");
+    print_testResult(test_iovec());
+    
+    /* TEST 12: HEAP MAP */
+    printf("\nTest 12: Testing the heap map...\n");
+    print_testResult(test_heapmap());
+    
+    /* TEST 13: SAMPLING PROFILER */
+    printf("\nTest 13: Testing the sampling profiler...\n");
+    print_testResult(test_profile());
+    
+    /* TEST 14: FREE COST AS HOLES GROW */
+    printf("\nTest 14: Testing that Free costs the same whatever the size of the hole...\n");
+    print_testResult(test_freeScaling());
+    
     return 0;
 }
+#endif
 
 
 
@@ -136,6 +346,93 @@ void PrintAddrs(void){
 }
 
 
+/* Finds the first set bit in the free map at or after granule from, or returns limit if there is none before it */
+static size_t findFreeScalar(const uint64_t* map, size_t from, size_t limit){
+    size_t words = (limit + 63)/64;
+    size_t w = from/64;
+    uint64_t word;
+    
+    if (from >= limit)
+        return limit;
+    word = map[w] & (~0ULL << (from % 64)); //ignore granules before from in the first word.
+    while (!word){
+        if (++w >= words)
+            return limit;
+        word = map[w];
+    }
+    from = w*64 + __builtin_ctzll(word);
+    return from < limit ? from : limit;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Same as findFreeScalar, but checks 256 granules (2 KB of heap) per compare while it is crossing allocated blocks */
+__attribute__((target("avx2")))
+static size_t findFreeAVX2(const uint64_t* map, size_t from, size_t limit){
+    size_t words = (limit + 63)/64;
+    size_t w = from/64;
+    uint64_t word;
+    __m256i zero = _mm256_setzero_si256();
+    
+    if (from >= limit)
+        return limit;
+    word = map[w] & (~0ULL << (from % 64));
+    w++;
+    
+    while (!word && w + 4 <= words){
+        unsigned int zeroBytes = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(map + w)), zero));
+        if (zeroBytes != 0xffffffff){ //some byte of these four words has a free granule.
+            size_t byte = w*8 + __builtin_ctz(~zeroBytes);
+            from = byte*8 + __builtin_ctz(((const unsigned char*)map)[byte]);
+            return from < limit ? from : limit;
+        }
+        w += 4;
+    }
+    while (!word){
+        if (w >= words)
+            return limit;
+        word = map[w++];
+    }
+    from = (w - 1)*64 + __builtin_ctzll(word);
+    return from < limit ? from : limit;
+}
+#endif
+
+/* Picks the fastest free map scan this CPU supports */
+static void selectKernels(void){
+    findFreeGranule = findFreeScalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        findFreeGranule = findFreeAVX2;
+#endif
+}
+
+/* Sets or clears the free map bits for the bytes length bytes from header */
+static void markFree(addrs_t header, size_t length, int isFree){
+    size_t g = GRANULE_OF(header);
+    size_t end = g + length/ALIGNMENT;
+    
+    while (g < end){
+        size_t bits = 64 - g % 64;
+        uint64_t mask;
+        if (bits > end - g)
+            bits = end - g;
+        mask = (bits == 64 ? ~0ULL : ((1ULL << bits) - 1)) << (g % 64);
+        if (isFree)
+            freeMap[g/64] |= mask;
+        else
+            freeMap[g/64] &= ~mask;
+        g += bits;
+    }
+}
+
+/* Finds the whole pages of M1 for the page map */
+static void setupPages(void){
+    addrs_t pageEnd = (addrs_t) ((uintptr_t) (basePointer + memSize) & ~(uintptr_t) (PAGE_SIZE - 1));
+    pageBase = (addrs_t) (((uintptr_t) basePointer + PAGE_SIZE - 1) & ~(uintptr_t) (PAGE_SIZE - 1));
+    pageCount = pageEnd > pageBase ? (pageEnd - pageBase)/PAGE_SIZE : 0;
+}
+
 void Init(size_t size){
     /*
      use the system malloc() routine (new in C++) only to allocate size bytes for the initial
@@ -149,13 +446,558 @@ void Init(size_t size){
     memSize = size;     // set the static memsize variable to track when the heap is full.
     rawFreeBytes = memSize-4; //subtract 4 from memSize in order to account for the 4 bytes included in the header.
     freeBlocks = 1;
+    memset(quickList, 0, sizeof(quickList)); //nothing is waiting to be merged in a new heap.
+    quickBlocks = 0;
+    freeMap = (uint64_t*) calloc (MAP_WORDS(size), sizeof(uint64_t)); //no free blocks below curPointer yet.
+    pageMap = (unsigned int*) calloc (PAGES(size) + 1, sizeof(unsigned int));
+    spanPointer = basePointer + memSize; //no large object spans yet.
+    setupPages();
+    selectKernels();
+}
+
+int InitMapped(size_t size){
+    /*
+     Init without malloc(): M1, the free map and the page map come from one anonymous mmap, so M1 can stand in for
+     malloc() itself. Pages only take memory once they are touched, so size can be generous. Returns 0 on success,
+     -1 if the mapping failed.
+     */
+    size_t heapBytes = (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    size_t length = heapBytes + MAP_WORDS(size)*sizeof(uint64_t) + (PAGES(size) + 1)*sizeof(unsigned int);
+    addrs_t region = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    
+    if (region == MAP_FAILED)
+        return -1;
+    mappedLength = length;
+    basePointer = region; //page aligned, and zeroed like the maps after it.
+    curPointer = basePointer + 4;
+    *basePointer = (unsigned int) size;
+    memSize = size;
+    rawFreeBytes = memSize-4;
+    freeBlocks = 1;
+    memset(quickList, 0, sizeof(quickList));
+    quickBlocks = 0;
+    freeMap = (uint64_t*) (region + heapBytes);
+    pageMap = (unsigned int*) (region + heapBytes + MAP_WORDS(size)*sizeof(uint64_t));
+    spanPointer = basePointer + memSize;
+    setupPages();
+    selectKernels();
+    return 0;
+}
+
+/* Picks up the end of the heap and the totals that other processes may have changed since we last held the lock.
+ Returns 0, or -1 without the lock once a process has died holding it and left M1 damaged. */
+static int lockHeap(void){
+    int rc;
+    
+    if (!shared)
+        return 0;
+    rc = pthread_mutex_lock(&shared->lock);
+    if (rc != 0 && rc != EOWNERDEAD)
+        return -1;
+    curPointer = basePointer + shared->curOffset;
+    spanPointer = basePointer + shared->spanOffset;
+    allocatedBlocks = shared->allocatedBlocks;
+    freeBlocks = shared->freeBlocks;
+    rawTotalAllocated = shared->rawTotalAllocated;
+    paddedTotalAllocated = shared->paddedTotalAllocated;
+    rawFreeBytes = shared->rawFreeBytes;
+    if (rc == EOWNERDEAD){
+        /* The holder died. The header only has what its last finished call published, but the blocks, the free map
+         and the page map are changed in place, so they may be half written. Check them before anyone carries on. */
+        pthread_mutex_consistent(&shared->lock);
+        if (!shared->unusable && VerifyHeap()){
+            fprintf(stderr, "M1: a process died holding the lock and left the heap damaged. it can no longer be used\n");
+            shared->unusable = 1;
+        }
+    }
+    if (shared->unusable){
+        pthread_mutex_unlock(&shared->lock);
+        return -1;
+    }
+    return 0;
+}
+
+/* Publishes our changes to the other processes and drops the lock */
+static void unlockHeap(void){
+    if (!shared)
+        return;
+    shared->curOffset = curPointer - basePointer;
+    shared->spanOffset = spanPointer - basePointer;
+    shared->allocatedBlocks = allocatedBlocks;
+    shared->freeBlocks = freeBlocks;
+    shared->rawTotalAllocated = rawTotalAllocated;
+    shared->paddedTotalAllocated = paddedTotalAllocated;
+    shared->rawFreeBytes = rawFreeBytes;
+    pthread_mutex_unlock(&shared->lock);
+}
+
+int InitShared(const char* name, size_t size){
+    /*
+     place M1 in the POSIX shared memory object name instead of using malloc(). The first process to get there
+     lays out an empty heap of size bytes, later ones attach to it and size is ignored. Addresses differ between
+     processes, so exchange OffsetOf() values rather than pointers. Returns 0 on success, -1 on failure.
+     */
+    struct sharedHeader* h;
+    pthread_mutexattr_t attr;
+    size_t mapBytes = (MAP_WORDS(size)*sizeof(uint64_t) + (PAGES(size) + 1)*sizeof(unsigned int) + SHARED_HEADER_SIZE - 1) & ~(size_t)(SHARED_HEADER_SIZE - 1);
+    size_t length = SHARED_HEADER_SIZE + mapBytes + size;
+    int fresh = 1;
+    
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST){
+        fresh = 0;
+        fd = shm_open(name, O_RDWR, 0600);
+        while (fd >= 0 && lseek(fd, 0, SEEK_END) == 0){ //created but not yet sized by its creator.
+            usleep(1000);
+        }
+    }
+    if (fd < 0)
+        return -1;
+    if (fresh && ftruncate(fd, length) < 0){ //a new object reads back as zeros, which is an empty free map.
+        close(fd);
+        return -1;
+    }
+    if (!fresh)
+        length = lseek(fd, 0, SEEK_END);
+    
+    h = (struct sharedHeader*) mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED){
+        close(fd);
+        return -1;
+    }
+    
+    if (fresh){
+        h->memSize = size;
+        h->mapOffset = SHARED_HEADER_SIZE;
+        h->pageMapOffset = SHARED_HEADER_SIZE + MAP_WORDS(size)*sizeof(uint64_t);
+        h->heapOffset = SHARED_HEADER_SIZE + mapBytes; //a page boundary, so every process numbers the pages the same way.
+        h->curOffset = 4;
+        h->spanOffset = size;
+        *((addrs_t) h + h->heapOffset) = (unsigned int) size;
+        h->allocatedBlocks = 0;
+        h->freeBlocks = 1;
+        h->rawTotalAllocated = 0;
+        h->paddedTotalAllocated = 0;
+        h->rawFreeBytes = size - 4;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&h->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        __atomic_store_n(&h->magic, SHARED_MAGIC, __ATOMIC_RELEASE); //last, so attaching processes never see half a header.
+    }
+    while (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != SHARED_MAGIC){ //the creating process is still laying out the heap.
+        usleep(1000);
+    }
+    
+    memSize = h->memSize;
+    basePointer = (addrs_t) h + h->heapOffset;
+    freeMap = (uint64_t*) ((addrs_t) h + h->mapOffset);
+    pageMap = (unsigned int*) ((addrs_t) h + h->pageMapOffset);
+    setupPages();
+    selectKernels();
+    shared = h;
+    sharedFd = fd;
+    sharedLength = length;
+    memset(quickList, 0, sizeof(quickList));
+    quickBlocks = 0;
+    if (lockHeap()){ //load the current end of the heap and totals.
+        Close();
+        return -1;
+    }
+    unlockHeap();
+    return 0;
+}
+
+void Close(void){
+    /* releases M1. a shared heap stays behind for the other processes until shm_unlink(). */
+    if (shared){
+        munmap(shared, sharedLength);
+        close(sharedFd);
+        shared = NULL;
+        sharedFd = -1;
+    }
+    else if (mappedLength){
+        munmap(basePointer, mappedLength);
+        mappedLength = 0;
+    }
+    else {
+        free(basePointer);
+        free(freeMap);
+        free(pageMap);
+    }
+    basePointer = curPointer = spanPointer = NULL;
+    freeMap = NULL;
+    pageMap = NULL;
+    
+    /* the blocks sampled are gone with the heap, but what was allocated from each stack still counts */
+    memset(liveSamples, 0, sizeof(liveSamples));
+    liveSampleCount = 0;
+    for (int i = 0; i < SAMPLE_SITES; i++){
+        sampleSites[i].inuseObjects = 0;
+        sampleSites[i].inuseBytes = 0;
+    }
+}
+
+/* Malloc'd addresses as offsets from the start of M1, for handing to another process sharing the heap */
+size_t OffsetOf(addrs_t addr){
+    return addr - basePointer;
+}
+
+addrs_t AddrAt(size_t offset){
+    return basePointer + offset;
+}
+
+static addrs_t mallocBlock(size_t, int);
+static void freeBlock(addrs_t);
+static void releaseBlock(addrs_t);
+static void flushQuickLists(void);
+static void selectKernels(void);
+static void setupPages(void);
+static addrs_t mallocLarge(size_t);
+static void freeLarge(addrs_t);
+static addrs_t unpad(addrs_t);
+static size_t blockSize(addrs_t);
+
+#ifdef HEAP_DEBUG
+/* Reports a bug found by the hardened build and stops before it can do more damage */
+static void heapCorruption(const char* what, addrs_t addr){
+    fprintf(stderr, "%sheap corruption%s: %s at offset %ld\n", KRED, KRESET, what, (long) (addr - basePointer));
+    abort();
+}
+#endif
+
+/* Writes the canary after the data of a block Malloc is handing out */
+static addrs_t armBlock(addrs_t header){
+#ifdef HEAP_DEBUG
+    *(uint64_t *)(header + ((*(unsigned int *)header) & ~0x7) - 4) = CANARY_OF(header);
+#endif
+    return header + 4;
+}
+
+/* log2 of x > 0 to about 1e-5 from its exponent and an atanh series for the mantissa, so the profiler needs no libm */
+static double fastLog2(double x){
+    union { double d; uint64_t u; } bits = { x };
+    int exponent = (int) ((bits.u >> 52) & 0x7ff) - 1023;
+    double z, z2;
+    
+    bits.u = (bits.u & ~(0x7ffULL << 52)) | (1023ULL << 52); //the mantissa alone, in [1, 2)
+    z = (bits.d - 1)/(bits.d + 1);
+    z2 = z*z;
+    return exponent + 2.8853900817779268*z*(1 + z2*(1.0/3 + z2*(1.0/5 + z2*(1.0/7)))); //2/ln 2 * atanh(z)
+}
+
+/* Bytes until the next sample, drawn from an exponential distribution with mean sampleRate as tcmalloc does. Every
+ byte Malloc'd then has the same chance of being sampled, however the requests are sized. */
+static long int nextSampleInterval(void){
+    double u;
+    if (!sampleRate)
+        return LONG_MAX;
+    sampleSeed ^= sampleSeed << 13;
+    sampleSeed ^= sampleSeed >> 7;
+    sampleSeed ^= sampleSeed << 17;
+    u = (double) ((sampleSeed >> 11) + 1)/9007199254740992.0; //in (0, 1]
+    return (long int) (-fastLog2(u)*0.6931471805599453*sampleRate) + 1;
+}
+
+/* Slot of the live sample for addr, or the empty slot where it would go */
+static size_t sampleSlot(addrs_t addr){
+    size_t slot = ((uintptr_t) addr >> 3) & (SAMPLE_SLOTS - 1);
+    while (liveSamples[slot].addr && liveSamples[slot].addr != addr)
+        slot = (slot + 1) & (SAMPLE_SLOTS - 1);
+    return slot;
+}
+
+/* Takes the sample for addr, if this process has one, out of the in use totals */
+static void dropSample(addrs_t addr){
+    size_t slot = sampleSlot(addr), next, home;
+    
+    if (!liveSamples[slot].addr)
+        return;
+    sampleSites[liveSamples[slot].site].inuseObjects--;
+    sampleSites[liveSamples[slot].site].inuseBytes -= liveSamples[slot].size;
+    liveSampleCount--;
+    
+    /* close the gap so the samples after it can still be found, moving back any whose probe started at or before it */
+    for (next = (slot + 1) & (SAMPLE_SLOTS - 1); liveSamples[next].addr; next = (next + 1) & (SAMPLE_SLOTS - 1)){
+        home = ((uintptr_t) liveSamples[next].addr >> 3) & (SAMPLE_SLOTS - 1);
+        if (((next - home) & (SAMPLE_SLOTS - 1)) >= ((next - slot) & (SAMPLE_SLOTS - 1))){
+            liveSamples[slot] = liveSamples[next];
+            slot = next;
+        }
+    }
+    liveSamples[slot].addr = NULL;
+}
+
+/* Records the stack of a block whose bytes ran the countdown out. Kept out of line so Malloc stays small. */
+static void __attribute__((noinline)) sampleBlock(addrs_t addr, size_t size){
+    void* stack[SAMPLE_DEPTH + 2];
+    uint64_t hash = 14695981039346656037ULL;
+    int depth, i, site;
+    size_t slot;
+    
+    sampleCountdown = nextSampleInterval();
+    if (sampling || !sampleRate || addr == NULL)
+        return;
+    if (liveSampleCount >= SAMPLE_SLOTS/2){ //keep the probes short.
+        droppedSamples++;
+        return;
+    }
+    
+    sampling = 1;
+    depth = backtrace(stack, SAMPLE_DEPTH + 2) - 2; //leave out sampleBlock and Malloc.
+    sampling = 0;
+    if (depth < 0)
+        depth = 0;
+    for (i = 0; i < depth; i++)
+        hash = (hash ^ (uintptr_t) stack[i + 2])*1099511628211ULL; //FNV-1a over the return addresses
+    hash |= 1;
+    
+    site = hash % SAMPLE_SITES;
+    for (i = 0; i < SAMPLE_SITES && sampleSites[site].hash && sampleSites[site].hash != hash; i++)
+        site = (site + 1) % SAMPLE_SITES;
+    if (i == SAMPLE_SITES){
+        droppedSamples++;
+        return;
+    }
+    if (!sampleSites[site].hash){
+        sampleSites[site].hash = hash;
+        sampleSites[site].depth = depth;
+        memcpy(sampleSites[site].stack, stack + 2, depth*sizeof(void*));
+    }
+    sampleSites[site].inuseObjects++;
+    sampleSites[site].inuseBytes += size;
+    sampleSites[site].allocObjects++;
+    sampleSites[site].allocBytes += size;
+    
+    slot = sampleSlot(addr);
+    if (liveSamples[slot].addr){ //a stale sample, left when another process sharing the heap freed the block.
+        dropSample(addr);
+        slot = sampleSlot(addr);
+    }
+    liveSamples[slot].addr = addr;
+    liveSamples[slot].size = size;
+    liveSamples[slot].site = site;
+    liveSampleCount++;
+    if (addr < spanPointer)
+        *(unsigned int *)(unpad(addr) - 4) |= SAMPLED;
 }
 
 addrs_t Malloc (size_t size){
     /* implement a memory allocation routine aligned on 8 byte boundaries.
      */
+    addrs_t addr;
+    if (lockHeap()){
+        reqfailCount++;
+        return NULL;
+    }
+    addr = mallocBlock(size, 1);
+    if ((sampleCountdown -= (long int) size) < 0)
+        sampleBlock(addr, size);
+    unlockHeap();
+    return addr;
+}
+
+addrs_t MallocAligned(size_t size, size_t align){
+    /* Malloc whose data starts on a multiple of align, a power of two. Large objects are already page aligned;
+     otherwise the block is Malloc'd align - 8 bytes bigger and the data moved up inside it. The word just before
+     moved data holds how far it moved, with bit 1 set since no header has it, so Free can find the real block. */
+    addrs_t addr = NULL, aligned;
+    
+    if (align == 0 || (align & (align - 1)) || size > memSize || align > memSize - size){ //before size + align can wrap.
+        reqfailCount++;
+        return NULL;
+    }
+    if (align <= ALIGNMENT)
+        return Malloc(size);
+    
+    if (lockHeap()){
+        reqfailCount++;
+        return NULL;
+    }
+    if (align <= PAGE_SIZE && ALIGNED(size) >= largeThreshold && (addr = mallocBlock(size, 1)) && !((uintptr_t) addr & (align - 1))){
+        if ((sampleCountdown -= (long int) size) < 0)
+            sampleBlock(addr, size);
+        unlockHeap();
+        return addr;
+    }
+    else if (addr) //the pages ran out and it landed in the small heap, so start again with room to move it.
+        freeBlock(addr);
+    
+    addr = mallocBlock(ALIGNED(size) + align - ALIGNMENT, 0);
+    if (addr == NULL){
+        unlockHeap();
+        return NULL;
+    }
+    aligned = (addrs_t) (((uintptr_t) addr + align - 1) & ~(uintptr_t) (align - 1));
+    if (aligned != addr)
+        *(unsigned int *)(aligned - 4) = (unsigned int) (aligned - addr) | 2; //at least 8 bytes past the header, so inside the block.
+    if ((sampleCountdown -= (long int) size) < 0)
+        sampleBlock(aligned, size);
+    unlockHeap();
+    return aligned;
+}
+
+/* Finds the data address Malloc returned for a block MallocAligned may have moved the data up in */
+static addrs_t unpad(addrs_t addr){
+    unsigned int word = *(unsigned int *)(addr - 4);
+    return (word & 2) ? addr - (word & ~0x7) : addr;
+}
+
+void Free(addrs_t addr){
+    if (lockHeap())
+        return;
+#ifdef HEAP_DEBUG
+    if (addr < basePointer + 8 || addr >= basePointer + memSize || ((uintptr_t) addr & (ALIGNMENT - 1)))
+        heapCorruption("Free of an address outside M1", addr);
+#endif
+    if (addr >= spanPointer){ //large objects are the only blocks above the small heap.
+        if (liveSampleCount)
+            dropSample(addr);
+        freeLarge(addr);
+    }
+    else {
+        if (*(unsigned int *)(unpad(addr) - 4) & SAMPLED){ //the sample may belong to another process sharing M1.
+            *(unsigned int *)(unpad(addr) - 4) &= ~SAMPLED;
+            dropSample(addr);
+        }
+        freeBlock(unpad(addr));
+    }
+    unlockHeap();
+}
+
+void FreeSized(addrs_t addr, size_t size){
+    /* Free for callers that know the size they asked for. Large objects are told apart by address and released from
+     the page map alone, so nothing at or around addr is read. Small blocks still go through their boundary tags,
+     which coalescing needs. A hardened build first checks size against the block: a large object must take the
+     same pages, a Malloc'd block exactly ALIGNED(size) bytes, and a MallocAligned(size, align) one align - 8 more
+     less however far its data moved up, so that slack plus the move plus 8 is a power of two. */
+#ifdef HEAP_DEBUG
+    size_t have, want = ALIGNED(size), slack;
+    
+    if (lockHeap())
+        return;
+    if (addr >= basePointer + 8 && addr < basePointer + memSize && !((uintptr_t) addr & (ALIGNMENT - 1))){ //Free reports any other address.
+        have = blockSize(addr);
+        slack = have - want + (addr - unpad(addr)) + ALIGNMENT;
+        if (addr >= spanPointer ? PAGES(want + CANARY_SIZE)*PAGE_SIZE != have : want > have || (slack & (slack - 1)))
+            heapCorruption("FreeSized with a size the block was not allocated with", addr);
+    }
+    unlockHeap();
+#endif
+    Free(addr);
+}
+
+void SetLargeThreshold(size_t size){
+    /* requests of at least size bytes are given whole pages from a span. blocks are told apart by address, so the
+     threshold can change at any time. */
+    largeThreshold = size;
+}
+
+/* Size of the data area of a block, from the page map for large objects and from the header otherwise */
+static size_t blockSize(addrs_t addr){
+    if (addr >= spanPointer)
+        return (size_t) (pageMap[PAGE_INDEX(addr)] >> 1)*PAGE_SIZE;
+    if (unpad(addr) != addr)
+        return ((*(unsigned int *) (unpad(addr) - 4)) & ~0x7) - (addr - unpad(addr)) - CANARY_SIZE;
+    return ((*(unsigned int *) (addr - 4)) & ~0x7) - CANARY_SIZE;
+}
+
+/* Sets the boundary tags of the span of length pages starting at page i */
+static void setSpan(size_t i, size_t length, int used){
+    pageMap[i] = pageMap[i + length - 1] = (unsigned int) (length << 1) | used;
+}
+
+/* Gives a large object whole pages, reusing the first free span that fits or growing the spans down towards curPointer */
+static addrs_t mallocLarge(size_t alignedSize){
+    size_t pages = PAGES(alignedSize);
+    size_t lowest = spanPointer < basePointer + memSize ? PAGE_INDEX(spanPointer) : pageCount;
+    size_t i;
+    
+    for (i = lowest; i < pageCount; i += pageMap[i] >> 1){
+        if (!(pageMap[i] & 1) && (pageMap[i] >> 1) >= pages){
+            if ((pageMap[i] >> 1) > pages) //split, leaving the rest of the span free above the object.
+                setSpan(i + pages, (pageMap[i] >> 1) - pages, 0);
+            setSpan(i, pages, 1);
+            return pageBase + i*PAGE_SIZE;
+        }
+    }
+    
+    if (lowest < pages || pageBase + (lowest - pages)*PAGE_SIZE < curPointer)
+        return NULL;
+    setSpan(lowest - pages, pages, 1);
+    spanPointer = pageBase + (lowest - pages)*PAGE_SIZE;
+    return spanPointer;
+}
+
+/* Frees a large object in O(1) using only the page map, merging it with free spans either side */
+static void freeLarge(addrs_t addr){
+    size_t i = PAGE_INDEX(addr);
+    size_t length = pageMap[i] >> 1;
+    
+#ifdef HEAP_DEBUG
+    if (((uintptr_t) addr & (PAGE_SIZE - 1)) || !(pageMap[i] & 1) || pageMap[i + length - 1] != pageMap[i])
+        heapCorruption("double Free or bad address for a large object", addr);
+#endif
+    
+    /* update static heap checker variables */
+    freeCount++;
+    rawTotalAllocated -= length*PAGE_SIZE;
+    rawFreeBytes += length*PAGE_SIZE;
+    paddedTotalAllocated -= length*PAGE_SIZE;
+    allocatedBlocks--;
+    
+    if (i + length < pageCount && !(pageMap[i + length] & 1)) //merge with the free span above.
+        length += pageMap[i + length] >> 1;
+    if (pageBase + i*PAGE_SIZE > spanPointer && !(pageMap[i - 1] & 1)){ //merge with the free span below, using its last page.
+        i -= pageMap[i - 1] >> 1;
+        length += pageMap[i] >> 1;
+    }
+    
+    if (pageBase + i*PAGE_SIZE == spanPointer) //the lowest span goes back to the small heap.
+        spanPointer = (i + length == pageCount) ? basePointer + memSize : pageBase + (i + length)*PAGE_SIZE;
+    else
+        setSpan(i, length, 0);
+}
+
+/* Finds the first free block of at least alignedSize bytes, or the end of the allotted memory if nothing fits inside
+ it. Returns the block's header, or NULL if the block would run past the end of M1. The free map takes the search
+ straight from one free block to the next, so only the headers of free blocks are read. */
+static addrs_t findFit(unsigned int alignedSize){
+    addrs_t searchPtr = curPointer;
+    size_t limit = GRANULE_OF(curPointer);
+    size_t g = 0;
+    
+    while ((g = findFreeGranule(freeMap, g, limit)) < limit){
+        addrs_t candidate = basePointer + 4 + g*ALIGNMENT; //free blocks are never next to each other, so a set bit after a clear one is a header.
+        unsigned int candidateSize = *(unsigned int *)candidate & -2;
+        if (candidateSize >= alignedSize){
+            searchPtr = candidate;
+            break;
+        }
+        g += (candidateSize + 8)/ALIGNMENT;
+    }
+    
+    /*if the block would go past the end of the heap, return null*/
+    if (searchPtr == curPointer && (curPointer + alignedSize + 8) > spanPointer)
+        return NULL;
+    return searchPtr;
+}
+
+/* Malloc and Free proper. They assume the heap lock is held when M1 is shared. */
+static addrs_t mallocBlock (size_t size, int allowLarge){
+
     
-    unsigned int alignedSize = ALIGNED(size); //align size by 8 - originally had size_t
+    unsigned int alignedSize; //block tags are 32 bit, so a size is only cut down to this once it is known to fit.
+    
+    if (size > memSize || ALIGNED(size) + CANARY_SIZE > memSize) //if the size request is greater than the size available, return NULL.
+    {
+        mallocCount++;
+        reqfailCount++;
+        return NULL;
+    }
+    alignedSize = ALIGNED(size) + CANARY_SIZE;
     
     /* update static heapChecker variables */
     mallocCount++;
@@ -163,22 +1005,39 @@ addrs_t Malloc (size_t size){
     paddedTotalAllocated+=(alignedSize+8);
     rawFreeBytes-=alignedSize;
     
-    if (alignedSize > memSize) //if the size request is greater than the size available, return NULL.
-    {
-        reqfailCount++;
-        return NULL;
+    /* large objects come from page spans. if there are no pages left they can still go in the small heap. */
+    if (allowLarge && alignedSize >= largeThreshold){
+        addrs_t largeBlock = mallocLarge(alignedSize);
+        if (largeBlock){
+            rawTotalAllocated += PAGES(alignedSize)*PAGE_SIZE - alignedSize;
+            paddedTotalAllocated += PAGES(alignedSize)*PAGE_SIZE - alignedSize - 8; //no header or footer, but whole pages.
+            rawFreeBytes -= PAGES(alignedSize)*PAGE_SIZE - alignedSize;
+            allocatedBlocks++;
+            return largeBlock;
+        }
+    }
+    
+    /* a block of exactly this size waiting on a quick list is still marked allocated, so it can be handed straight back. */
+    if (deferredCoalescing && QUICK_INDEX(alignedSize) && quickList[QUICK_INDEX(alignedSize)]){
+        addrs_t quickBlock = basePointer + quickList[QUICK_INDEX(alignedSize)];
+        quickList[QUICK_INDEX(alignedSize)] = *(unsigned int *)quickBlock; //the data holds the offset of the next block on the list.
+        quickBlocks--;
+        *(unsigned int *)(quickBlock + alignedSize) |= 1; //allocated in the footer again too.
+        return armBlock(quickBlock - 4);
     }
     
     /* locate the first available block for allocation. may be segmented within or at the end of the allocated block. */
     addrs_t memBlock;
-    addrs_t searchPtr = basePointer + 4;
-    while ((searchPtr != curPointer) && ((*searchPtr & 1) || ( (*searchPtr & -2) < alignedSize))){
-        searchPtr = searchPtr + (*(unsigned int *)searchPtr & -2) + 8;
-    }
+    addrs_t searchPtr = findFit(alignedSize);
     
+    /* only now is it worth merging the blocks on the quick lists, then look again. */
+    if (searchPtr == NULL && quickBlocks){
+        flushQuickLists();
+        searchPtr = findFit(alignedSize);
+    }
     
     /*if searchPtr ends up being the end of the heap, return null*/
-    if (searchPtr >= (basePointer + memSize))
+    if (searchPtr == NULL)
     {
         reqfailCount++;
         return NULL;
@@ -192,13 +1051,15 @@ addrs_t Malloc (size_t size){
         *(unsigned int*)(memBlock + alignedSize + 4) = (unsigned int) alignedSize | 1; //set the footer of the block to also be the size, also adding 1 to denote allocation.
         curPointer = memBlock + (*(unsigned int *)memBlock & -2) + 8; // set the curPointer to be the byte following the allocated block (accounting for the 4 byte footer)
         allocatedBlocks++; //update heapChecker variable accordingly.
-        return memBlock + 4; //return address to the start of the data within the newly allocated block.
+        return armBlock(memBlock); //return address to the start of the data within the newly allocated block.
     }
     
     //otherwise searchPointer is an internal block and needs to be potentially split
     unsigned int oldSize = *(unsigned int *) searchPtr & -2; //type cast to be a 4 byte word, and mask out allocation bit.
     *(unsigned int *)searchPtr = alignedSize | 1; // marks that it is now an allocated block.
-    *(searchPtr + alignedSize + 4) = alignedSize | 1; //mark the footer.
+    *(unsigned int *)(searchPtr + alignedSize + 4) = alignedSize | 1; //mark the footer.
+    
+    markFree(searchPtr, alignedSize + 8, 0); //a remainder left by a split keeps its bits.
     
     if (alignedSize == oldSize){ //if there is no internal segmentation.
         allocatedBlocks++;
@@ -206,29 +1067,63 @@ addrs_t Malloc (size_t size){
     }
     
     if (alignedSize < oldSize){ //if there is internal segmentation, update the blocks accordingly.
-        unsigned int sizeDif = oldSize - alignedSize; //find the difference in the size needed to separate the blocks.
-        *(searchPtr + alignedSize + 8) = sizeDif; //set the rest of the un-allocated internal block to have the new size that it needs.
-        *(searchPtr + alignedSize + 12 + sizeDif) = sizeDif; //set the footer of the split block to hold the size.
+        unsigned int sizeDif = oldSize - alignedSize - 8; //the rest of the block, less the header and footer the split adds.
+        *(unsigned int *)(searchPtr + alignedSize + 8) = sizeDif; //set the rest of the un-allocated internal block to have the new size that it needs.
+        *(unsigned int *)(searchPtr + alignedSize + 12 + sizeDif) = sizeDif; //set the footer of the split block to hold the size.
         allocatedBlocks++;
+        splitCount++;
     }
     
-    return searchPtr + 4; // return the address to the start of the data in the new block
+    return armBlock(searchPtr); // return the address to the start of the data in the new block
 }
 
-void Free(addrs_t addr){
+static void freeBlock(addrs_t addr){
     
     
     /* find addresses of all the memory blocks*/
-    addrs_t footer, header;
-    header = (addr - 4);
-    size_t size = (*(unsigned int *) header) & ~0x7;
-    footer = (header + size +4);
+    size_t size = (*(unsigned int *) (addr - 4)) & ~0x7;
+    
+#ifdef HEAP_DEBUG
+    /* a freed block, or one on a quick list, has the allocation bit clear in its footer */
+    if (addr + size >= curPointer || (*(unsigned int *)(addr + size) & ~0x6) != (*(unsigned int *)(addr - 4) & ~0x6))
+        heapCorruption("header and footer disagree", addr - 4);
+    if (!(*(unsigned int *)(addr - 4) & 1) || !(*(unsigned int *)(addr + size) & 1))
+        heapCorruption("double Free", addr - 4);
+    if (*(uint64_t *)(addr + size - CANARY_SIZE) != CANARY_OF(addr - 4))
+        heapCorruption("write past the end of a block", addr - 4);
+    for (size_t w = 0; w < size; w += 8) //word stores, the payload is a multiple of 8; reads of freed data now show up as 0xdd.
+        *(uint64_t *)(addr + w) = POISON_WORD;
+#endif
     
     /* update static heap checker variables */
     freeCount++;
     rawTotalAllocated -= size;
     rawFreeBytes+=size;
     paddedTotalAllocated -= (size+8);
+    
+    /* in deferred mode small blocks stay marked allocated on the quick list for their size rather than merging now. */
+    if (deferredCoalescing && QUICK_INDEX(size)){
+        *(unsigned int *)addr = quickList[QUICK_INDEX(size)];
+        quickList[QUICK_INDEX(size)] = addr - basePointer;
+        quickBlocks++;
+        *(unsigned int *)(addr + size) &= ~1; //free in the footer only, so a second Free or VerifyHeap can tell.
+        return;
+    }
+    
+    releaseBlock(addr);
+}
+
+/* Marks a block free and coalesces it with free neighbours through the boundary tags */
+static void releaseBlock(addrs_t addr){
+    
+    
+    /* find addresses of all the memory blocks*/
+    addrs_t footer, header;
+    header = (addr - 4);
+    size_t size = (*(unsigned int *) header) & ~0x7;
+    size_t ownSize = size; //the neighbours merged in below already have their free map bits set.
+    footer = (header + size +4);
+    
     freeBlocks++;
     
     /* mark the header and footer of the freed block to be free */
@@ -236,6 +1131,7 @@ void Free(addrs_t addr){
     (*(unsigned int*)footer) = (size & -2);
     
     int colNext = 0;
+    addrs_t merged = header; //header of the block once coalescing is done
     
     /* find addresses of the next block */
     addrs_t next, nxthdr, nxtftr;
@@ -245,7 +1141,7 @@ void Free(addrs_t addr){
     {
         next += 4;
         nxthdr = (next - 4);
-        size_t nextsize = (*(unsigned int *) next)& ~0x7;
+        size_t nextsize = (*(unsigned int *) nxthdr)& ~0x7;
         nxtftr = (next + nextsize);
         //Checks to see if next needs to be coalesced
         
@@ -256,12 +1152,14 @@ void Free(addrs_t addr){
             (*(unsigned int *)nxtftr) = (size & -2);
             colNext = 1;
             freeBlocks--; //one less freeblock since two blocks will be coalesced
+            mergeCount++;
         }
     }
     
     else
     {
         curPointer = header; //if the next pointer is at the curPointer, move the curPointer back to account for free.
+        mergeCount++;
     }
     
     
@@ -279,8 +1177,10 @@ void Free(addrs_t addr){
                 curPointer = prvhdr;
             }
             freeBlocks--; //one less freeblock since the prior block is coalesced as well.
+            mergeCount++;
             size+=prevsize+8; //update block size based on previous size.
             (*(unsigned int *)prvhdr)= (size & -2); //set the header of the previous block to the updated size.
+            merged = prvhdr;
             
             
             if (colNext) //update the correct footer based on size.
@@ -297,9 +1197,308 @@ void Free(addrs_t addr){
         freeBlocks = 1;
     }
     
+    /* only this block's granules change, so Free stays O(1) however big the hole it joins. if the merged block went
+     back past curPointer, which the map leaves clear, the previous free block's bits are cleared instead. */
+    if (merged < curPointer)
+        markFree(header, ownSize + 8, 1);
+    else if (merged != header)
+        markFree(merged, header - merged, 0);
+    
     allocatedBlocks--; //decrement the number of allocatedBlock.
 }
 
+/* Frees every block waiting on the quick lists, coalescing as Free normally would */
+static void flushQuickLists(void){
+    int i;
+    for (i = 1; i <= QUICK_LISTS; i++){
+        while (quickList[i]){
+            addrs_t quickBlock = basePointer + quickList[i];
+            quickList[i] = *(unsigned int *)quickBlock;
+            releaseBlock(quickBlock);
+        }
+    }
+    quickBlocks = 0;
+}
+
+void Sweep(void){
+    /* merges the blocks deferred coalescing has held back. call periodically, e.g. between requests, to limit fragmentation. */
+    if (lockHeap())
+        return;
+    flushQuickLists();
+    unlockHeap();
+}
+
+void SetDeferredCoalescing(int on){
+    /* in deferred mode Free puts blocks of up to QUICK_LISTS*ALIGNMENT bytes on a quick list for their size instead of
+     coalescing, and Malloc reuses them whole. They are merged only when Malloc cannot otherwise succeed or Sweep() runs.
+     The quick lists belong to this process, so in a shared heap other processes just see the blocks as allocated. */
+    if (lockHeap())
+        return;
+    if (!on)
+        flushQuickLists();
+    deferredCoalescing = on;
+    unlockHeap();
+}
+
+
+int VerifyHeap(void){
+    /*
+     walk M1 once and check that every header matches its footer, the blocks end exactly at curPointer, no two free
+     blocks are next to each other, the free map agrees with the blocks, the quick lists hold as many blocks as
+     they should and the large object spans are well formed. In a HEAP_DEBUG build the canary after every
+     allocated block is checked as well. Prints each problem and returns how many were found,
+     or -1 once a process has died holding the lock and left a shared M1 damaged.
+     */
+    int problems = 0;
+    int prevFree = 0;
+    long int quickSeen = 0;
+    addrs_t block = basePointer + 4;
+    size_t i;
+    
+    if (lockHeap())
+        return -1;
+    while (block < curPointer){
+        unsigned int head = *(unsigned int *)block;
+        size_t size = head & ~0x7;
+        unsigned int foot;
+        
+        if (block + size + 8 > curPointer){
+            fprintf(stderr, "VerifyHeap: block at offset %ld runs past curPointer\n", (long) (block - basePointer));
+            problems++;
+            break;
+        }
+        foot = *(unsigned int *)(block + size + 4);
+        if ((foot & ~0x7) != size || (foot & 1) > (head & 1)){
+            fprintf(stderr, "VerifyHeap: header and footer of block at offset %ld disagree\n", (long) (block - basePointer));
+            problems++;
+        }
+        else if ((head & 1) && !(foot & 1)) //allocated in the header only: waiting on a quick list.
+            quickSeen++;
+        if (!(head & 1) && prevFree){
+            fprintf(stderr, "VerifyHeap: free block at offset %ld was not coalesced\n", (long) (block - basePointer));
+            problems++;
+        }
+        if (((freeMap[GRANULE_OF(block)/64] >> (GRANULE_OF(block) % 64)) & 1) != !(head & 1)){
+            fprintf(stderr, "VerifyHeap: free map is wrong for block at offset %ld\n", (long) (block - basePointer));
+            problems++;
+        }
+#ifdef HEAP_DEBUG
+        if ((head & 1) && (foot & 1) && *(uint64_t *)(block + size + 4 - CANARY_SIZE) != CANARY_OF(block)){
+            fprintf(stderr, "VerifyHeap: canary of block at offset %ld was overwritten\n", (long) (block - basePointer));
+            problems++;
+        }
+#endif
+        prevFree = !(head & 1);
+        block += size + 8;
+    }
+    if (prevFree){
+        fprintf(stderr, "VerifyHeap: free block left just below curPointer\n");
+        problems++;
+    }
+    if (quickSeen != quickBlocks){
+        fprintf(stderr, "VerifyHeap: %ld blocks on the quick lists but %ld counted\n", quickSeen, quickBlocks);
+        problems++;
+    }
+    
+    if (curPointer > spanPointer){
+        fprintf(stderr, "VerifyHeap: small heap runs into the large object spans\n");
+        problems++;
+    }
+    for (i = spanPointer < basePointer + memSize ? PAGE_INDEX(spanPointer) : pageCount; i < pageCount; i += pageMap[i] >> 1){
+        size_t length = pageMap[i] >> 1;
+        if (!length || i + length > pageCount || pageMap[i + length - 1] != pageMap[i]){
+            fprintf(stderr, "VerifyHeap: span at page %zu is damaged\n", i);
+            problems++;
+            break;
+        }
+        if (!(pageMap[i] & 1) && i + length < pageCount && !(pageMap[i + length] & 1)){
+            fprintf(stderr, "VerifyHeap: free span at page %zu was not merged\n", i);
+            problems++;
+        }
+    }
+    unlockHeap();
+    return problems;
+}
+
+
+enum { MAP_ALLOC, MAP_FREE, MAP_QUICK, MAP_LARGE, MAP_LARGE_FREE, MAP_UNUSED };
+static const char* mapStates[] = {"alloc", "free", "quick", "large", "large_free", "unused"};
+
+int DumpHeapMap(FILE* out){
+    /*
+     write a map of M1 to out as CSV: one row of offset, size, state and handle for every block, span and the
+     unused space between the small heap and the spans, then the free bytes, the fragmentation index (1 - largest
+     free run / free bytes) and a histogram of free runs by power of two size as # comments. M1 has no handles, so
+     that column is left empty. The heap is only locked while the rows are copied out with one walk; the text is
+     formatted after it is unlocked. Returns 0, or -1 if there was no memory for the copy.
+     */
+    size_t capacity = memSize/8 + pageCount + 1; //the smallest block is 8 bytes, Malloc(0), and the smallest span a page.
+    struct mapEntry* rows;
+    size_t count = 0, n, i, freeBytes = 0, largest = 0, freeRuns = 0;
+    size_t histogram[64] = {0};
+    addrs_t block;
+    
+    rows = mmap(NULL, capacity*sizeof(struct mapEntry), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0); //not Malloc, which would change the heap being mapped.
+    if (rows == MAP_FAILED)
+        return -1;
+    
+    if (lockHeap()){
+        munmap(rows, capacity*sizeof(struct mapEntry));
+        return -1;
+    }
+    for (block = basePointer + 4; block < curPointer; block += (*(unsigned int *)block & ~0x7) + 8){
+        unsigned int head = *(unsigned int *)block;
+        rows[count].offset = block - basePointer;
+        rows[count].size = (head & ~0x7) + 8;
+        if (!(head & 1))
+            rows[count].state = MAP_FREE;
+        else if (!(*(unsigned int *)(block + (head & ~0x7) + 4) & 1)) //allocated in the header only: on a quick list.
+            rows[count].state = MAP_QUICK;
+        else
+            rows[count].state = MAP_ALLOC;
+        count++;
+    }
+    if (curPointer < spanPointer){
+        rows[count].offset = curPointer - basePointer;
+        rows[count].size = spanPointer - curPointer;
+        rows[count++].state = MAP_UNUSED;
+    }
+    for (i = spanPointer < basePointer + memSize ? PAGE_INDEX(spanPointer) : pageCount; i < pageCount; i += pageMap[i] >> 1){
+        rows[count].offset = pageBase + i*PAGE_SIZE - basePointer;
+        rows[count].size = (size_t) (pageMap[i] >> 1)*PAGE_SIZE;
+        rows[count++].state = (pageMap[i] & 1) ? MAP_LARGE : MAP_LARGE_FREE;
+    }
+    unlockHeap();
+    
+    fprintf(out, "offset,size,state,handle\n");
+    for (i = 0; i < count; i++){
+        fprintf(out, "%zu,%zu,%s,\n", rows[i].offset, rows[i].size, mapStates[rows[i].state]);
+        if (rows[i].state == MAP_FREE || rows[i].state == MAP_LARGE_FREE || rows[i].state == MAP_UNUSED){
+            freeBytes += rows[i].size;
+            freeRuns++;
+            if (rows[i].size > largest)
+                largest = rows[i].size;
+            histogram[63 - __builtin_clzll(rows[i].size)]++;
+        }
+    }
+    fprintf(out, "# free bytes %zu in %zu runs, largest run %zu\n", freeBytes, freeRuns, largest);
+    fprintf(out, "# fragmentation index %.4f\n", freeBytes ? 1.0 - (double) largest/freeBytes : 0.0);
+    for (n = 0; n < 64; n++)
+        if (histogram[n])
+            fprintf(out, "# free runs of %zu-%zu bytes: %zu\n", (size_t) 1 << n, ((size_t) 2 << n) - 1, histogram[n]);
+    
+    munmap(rows, capacity*sizeof(struct mapEntry));
+    return 0;
+}
+
+
+void SetSampleRate(size_t bytes){
+    /* start sampling about one in every bytes bytes Malloc'd, or stop with 0. the cumulative totals are kept. */
+    if (bytes){
+        void* prime[1];
+        sampling = 1;
+        backtrace(prime, 1); //the first backtrace() loads the unwinder, which allocates. get that out of the way here.
+        sampling = 0;
+    }
+    if (lockHeap())
+        return;
+    sampleRate = bytes;
+    sampleCountdown = nextSampleInterval();
+    unlockHeap();
+}
+
+int DumpHeapProfile(FILE* out){
+    /*
+     write the sampled allocations to out as a legacy pprof heap profile, which pprof reads directly: a total line,
+     then one line per call stack with the objects and bytes still in use, the objects and bytes allocated since
+     profiling started in brackets, and the return addresses. The counts are of samples only; the heap_v2/rate in
+     the first line tells pprof how to scale them up. /proc/self/maps follows so pprof can find the symbols. As in
+     DumpHeapMap the sites are copied out under the lock and formatted after. Returns 0, or -1 if there was no
+     memory for the copy.
+     */
+    struct sampleSite* sites;
+    struct sampleSite total = {0};
+    size_t count = 0, i;
+    char buffer[4096];
+    ssize_t n;
+    int fd, j;
+    
+    sites = mmap(NULL, sizeof(sampleSites), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (sites == MAP_FAILED)
+        return -1;
+    if (lockHeap())
+        return -1;
+    for (i = 0; i < SAMPLE_SITES; i++)
+        if (sampleSites[i].hash)
+            sites[count++] = sampleSites[i];
+    unlockHeap();
+    
+    for (i = 0; i < count; i++){
+        total.inuseObjects += sites[i].inuseObjects;
+        total.inuseBytes += sites[i].inuseBytes;
+        total.allocObjects += sites[i].allocObjects;
+        total.allocBytes += sites[i].allocBytes;
+    }
+    fprintf(out, "heap profile: %ld: %ld [%ld: %ld] @ heap_v2/%zu\n", total.inuseObjects, total.inuseBytes,
+            total.allocObjects, total.allocBytes, sampleRate);
+    for (i = 0; i < count; i++){
+        fprintf(out, "%ld: %ld [%ld: %ld] @", sites[i].inuseObjects, sites[i].inuseBytes, sites[i].allocObjects, sites[i].allocBytes);
+        for (j = 0; j < sites[i].depth; j++)
+            fprintf(out, " %p", sites[i].stack[j]);
+        fprintf(out, "\n");
+    }
+    munmap(sites, sizeof(sampleSites));
+    
+    fprintf(out, "\nMAPPED_LIBRARIES:\n");
+    fd = open("/proc/self/maps", O_RDONLY);
+    if (fd >= 0){
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+            fwrite(buffer, 1, n, out);
+        close(fd);
+    }
+    return 0;
+}
+
+
+int RegionInit(region_t* region, size_t size){
+    /* take size bytes from M1 for the region with one Malloc. returns 0 on success, -1 if M1 is out of space. */
+    region->base = Malloc(size);
+    if (region->base == NULL){
+        region->top = region->end = NULL;
+        return -1;
+    }
+    region->top = region->base;
+    region->end = region->base + ALIGNED(size); //Malloc rounded the block up, so the padding is ours too.
+    return 0;
+}
+
+addrs_t RegionMalloc(region_t* region, size_t size){
+    /* bump size bytes off the top of the region, keeping 8 byte alignment. returns NULL once the region is full. */
+    addrs_t block = region->top;
+    size_t left = region->end - block;
+    
+    if (size > left || ALIGNED(size) > left) //size first, so rounding it up cannot wrap.
+        return NULL;
+    region->top = block + ALIGNED(size);
+    return block;
+}
+
+addrs_t RegionMark(region_t* region){
+    /* marks the current top of the region. marks nest like a stack: releasing to an outer mark drops the inner ones as well. */
+    return region->top;
+}
+
+void RegionRelease(region_t* region, addrs_t mark){
+    /* gives back every block RegionMalloc'd since mark in O(1). nothing in M1 is touched. */
+    region->top = mark;
+}
+
+void RegionFree(region_t* region){
+    /* returns the whole region to M1 with a single Free. */
+    Free(region->base);
+    region->base = region->top = region->end = NULL;
+}
+
 
 addrs_t Put(any_t data, size_t size){
     /*allocate size bytes from M1 using Malloc(). Copy size bytes of data into Malloc'd memory.
@@ -311,31 +1510,70 @@ addrs_t Put(any_t data, size_t size){
         return NULL;
     }
     
-    memcpy(( (void*) (baseAddress)),data,size); //Copies data to the address returned by the call to Malloc
+    memcpy(( (void*) (baseAddress)),data,size); //Copies data to the address returned by the call to Malloc. The block is ours, so no lock is needed.
     return baseAddress;
     
 }
 
+addrs_t PutV(const struct iovec* iov, int iovcnt){
+    /* Put for data in several pieces, such as the header and payload of a network frame. Allocates one block for
+     all of them and copies them in back to back. Returns the starting address of the block.
+     */
+    size_t total = 0;
+    addrs_t baseAddress, next;
+    int i;
+    
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    baseAddress = Malloc(total);
+    if (baseAddress == NULL){
+        return NULL;
+    }
+    
+    for (i = 0, next = baseAddress; i < iovcnt; next += iov[i].iov_len, i++)
+        memcpy(next, iov[i].iov_base, iov[i].iov_len);
+    return baseAddress;
+}
+
 void Get(any_t return_data, addrs_t addr, size_t size){
     /* copy size bytes from addr in the memory area, M1, to data address.
      As with Put(), you can assume data is a storage area outside M1. De-allocate size
      bytes of memory starting from addr using Free().
+     Only the block at addr is read and freed, so at most its data size is copied.
      */
+    size_t cursize;
     
-    *((unsigned int * )return_data) =  *((unsigned int *)addr);
-    
-    size_t cursize = (*(unsigned int *) (addr - 4)) & ~0x7;
-    addrs_t next = (addr + cursize + 4);
+    if (lockHeap()) //in a shared heap another process may have made the block, so its size is looked up with the heap current.
+        return;
+    cursize = blockSize(addr);
+    memcpy(return_data, addr, size < cursize ? size : cursize);
     Free(addr);
-    while (size > cursize && next < curPointer){
-        size -= cursize;
-        *((unsigned int * )return_data) +=  *((unsigned int *)next+ 4);
-        cursize = (*(unsigned int *) (next)) & ~0x7;
-        Free(next + 4);
-        next = (next + cursize + 8);
-    }
-    
+    unlockHeap();
+}
+
+size_t GetV(const struct iovec* iov, int iovcnt, addrs_t addr){
+    /* Get into several buffers: fills each in turn from the data of the block at addr, then frees the block.
+     Returns the number of bytes copied, which is less than the buffers hold if the block is smaller. Blocks only
+     keep their size rounded up to ALIGNMENT, so the count includes up to 7 bytes of padding after the data that
+     was put in, and those bytes hold whatever was there before. Callers that need the exact length keep it
+     themselves, in the data or alongside the address.
+     */
+    size_t left, n;
+    addrs_t next = addr;
+    int i;
     
+    if (lockHeap())
+        return 0;
+    left = blockSize(addr);
+    for (i = 0; i < iovcnt && left; i++){
+        n = iov[i].iov_len < left ? iov[i].iov_len : left;
+        memcpy(iov[i].iov_base, next, n);
+        next += n;
+        left -= n;
+    }
+    Free(addr);
+    unlockHeap();
+    return next - addr;
 }
 
 
@@ -364,6 +1602,12 @@ void heapChecker(){
     
     printf("Total number of request failures: %ld\n",reqfailCount); //TOTAL which were unable to satisfy the allocation or de-allocation requests
     
+    printf("Number of blocks split: %ld\n",splitCount); //SPLITS of a free block by Malloc
+    
+    printf("Number of blocks merged: %ld\n",mergeCount); //MERGES by Free, with a neighbour or into the end of the heap
+    
+    printf("Number of blocks waiting on quick lists: %ld\n",quickBlocks); //QUICK LIST blocks held back by deferred coalescing
+    
     printf("Average clock cycles for a Malloc request: %ld\n",tot_alloc_time); //tot_alloc_time and below is allocated based on different program calls.
     
     printf("Average clock cycles for a Free request: %ld\n",tot_free_time);
@@ -374,6 +1618,7 @@ void heapChecker(){
 
 
 
+#ifndef MEMORY_MANAGER_LIBRARY
 /* BELOW ARE EMBEDDED TEST SUITES FROM OUR TFS IN ORDER TO IMPLEMENT TESTING OF OUR HEAP*/
 
 void print_testResult(int code){
@@ -441,7 +1686,6 @@ int test_stability(int numIterations, unsigned long* tot_alloc_time, unsigned lo
     char s[80];
     addrs_t addr1;
     addrs_t addr2;
-    char data[80];
     char data2[80];
     
     unsigned long start, finish;
@@ -468,10 +1712,10 @@ int test_stability(int numIterations, unsigned long* tot_alloc_time, unsigned lo
         Get((any_t)data2, addr2, n+1);
         rdtsc(&finish);
         *tot_free_time += finish - start;
-        if (!strcmp(data,data2))
+        if (strcmp(s,data2))
             res |= ERROR_DATA_INCON;
         Get((any_t)data2, addr1, n+1);
-        if (!strcmp(data,data2))
+        if (strcmp(s,data2))
             res |= ERROR_DATA_INCON;
     }
     return res;
@@ -508,4 +1752,529 @@ int test_maxSizeOfAlloc(int size){
 }
 
 
+int test_shared(void){
+    // A block Put by one process should be readable by another through its offset
+    char name[32];
+    char s[] = "from the child";
+    size_t *offset;
+    size_t slot;
+    int status;
+    int i, err = 0;
+    pid_t pid;
+    
+    snprintf(name, sizeof(name), "/mheap_test_%d", (int)getpid());
+    shm_unlink(name);
+    Close(); // Done with the heap used by the earlier tests
+    if (InitShared(name, 1<<16))
+        return ERROR_OUT_OF_MEM;
+    offset = (size_t*) Malloc(sizeof(size_t)); // The first block is where the child leaves its offset
+    slot = OffsetOf((addrs_t) offset);
+    
+    pid = fork();
+    if (pid == 0){
+        Close();
+        if (InitShared(name, 0))
+            _exit(1);
+        addrs_t v1 = Put(s, sizeof(s));
+        if (!v1)
+            _exit(1);
+        *(size_t*) AddrAt(slot) = OffsetOf(v1);
+        _exit(0);
+    }
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+        return ERROR_OUT_OF_MEM;
+    
+    addrs_t v1 = AddrAt(*offset);
+    if ((uint64_t)v1 & (ALIGNMENT-1))
+        err |= ERROR_ALIGMENT;
+    if (strcmp(v1, s))
+        err |= ERROR_DATA_INCON;
+    Free(v1);
+    Free((addrs_t) offset);
+    
+    // A process that dies holding the lock leaves M1 usable if it was between changes, and unusable if it was half way
+    for (i = 0; i < 2; i++){
+        v1 = Malloc(16);
+        slot = OffsetOf(v1);
+        if (i)
+            printf("Expect a report of a heap left damaged by a process that died holding the lock:\n");
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0){
+            Close();
+            if (InitShared(name, 0) || lockHeap())
+                _exit(1);
+            if (i)
+                *(unsigned int *)(AddrAt(slot) + 16 + CANARY_SIZE) = 0; // The footer, as a Free cut short would leave it
+            _exit(0);
+        }
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            return ERROR_OUT_OF_MEM;
+        if (i == 0){
+            if (VerifyHeap())
+                err |= ERROR_DATA_INCON;
+            Free(v1);
+        }
+        else if (Malloc(8) || VerifyHeap() != -1)
+            err |= ERROR_DATA_INCON;
+    }
+    Close();
+    if (InitShared(name, 0) == 0) // Nobody can attach to it any more either
+        err |= ERROR_DATA_INCON;
+    shm_unlink(name);
+    return err;
+}
+
+
+int test_region(void){
+    // Blocks in a region follow one another, and releasing a mark hands the same space out again
+    region_t region;
+    addrs_t outer, inner, v1, v2, v3;
+    int err = 0;
+    
+    Close(); // Done with the heap used by the earlier tests
+    Init(1<<16);
+    if (RegionInit(&region, 1000))
+        return ERROR_OUT_OF_MEM;
+    
+    outer = RegionMark(&region);
+    v1 = RegionMalloc(&region, 5);
+    inner = RegionMark(&region);
+    v2 = RegionMalloc(&region, 100);
+    if (!v1 || !v2)
+        err |= ERROR_OUT_OF_MEM;
+    if (LOCATION_OF(v2) != LOCATION_OF(v1) + ALIGNMENT)
+        err |= ERROR_NOT_FF;
+    if ((LOCATION_OF(v1) & (ALIGNMENT-1)) || (LOCATION_OF(v2) & (ALIGNMENT-1)))
+        err |= ERROR_ALIGMENT;
+    
+    RegionRelease(&region, inner);
+    v3 = RegionMalloc(&region, 8);
+    if (LOCATION_OF(v3) != LOCATION_OF(v2))
+        err |= ERROR_NOT_FF;
+    
+    RegionRelease(&region, outer);
+    if (RegionMalloc(&region, (size_t) 1 << 32) || RegionMalloc(&region, SIZE_MAX)) // Sizes that wrap when rounded must not fit
+        err |= ERROR_DATA_INCON;
+    if (RegionMalloc(&region, 1000) != v1 || RegionMalloc(&region, 1))
+        err |= ERROR_DATA_INCON;
+    
+    RegionFree(&region);
+    if (Malloc(1000) != v1) // The region's block should be back in M1
+        err |= ERROR_NOT_FF;
+    return err;
+}
+
+
+int test_deferred(int numIterations){
+    // Runs the stability test with eager then deferred coalescing, and reports the split and merge work each one did
+    unsigned long alloc_time, free_time;
+    long int splits, merges;
+    int err = 0;
+    
+    Close(); // Done with the heap used by the earlier tests
+    Init(DEFAULT_MEM_SIZE);
+    splits = splitCount;
+    merges = mergeCount;
+    err |= test_stability(numIterations, &alloc_time, &free_time);
+    printf("Eager: %ld splits, %ld merges, %lu clock cycles\n", splitCount - splits, mergeCount - merges, alloc_time + free_time);
+    
+    SetDeferredCoalescing(1);
+    splits = splitCount;
+    merges = mergeCount;
+    err |= test_stability(numIterations, &alloc_time, &free_time);
+    Sweep();
+    printf("Deferred: %ld splits, %ld merges, %lu clock cycles\n", splitCount - splits, mergeCount - merges, alloc_time + free_time);
+    SetDeferredCoalescing(0);
+    
+    // Everything was freed, so after the sweep the heap should be empty again
+    if (quickBlocks || curPointer != basePointer + 4)
+        err |= ERROR_DATA_INCON;
+    err |= test_ff();
+    return err;
+}
+
+
+int test_large(void){
+    // Large objects should be page aligned, reuse freed spans first-fit and hand their pages back to the small heap
+    addrs_t v1, v2, v3, v4;
+    int err = 0;
+#ifdef HEAP_DEBUG
+    int status;
+    pid_t pid;
+#endif
+    
+    Close(); // Done with the heap used by the earlier tests
+    Init(1<<20);
+    v1 = Malloc(200000);
+    v2 = Malloc(300000);
+    v3 = Malloc(100);
+    if (!v1 || !v2 || !v3)
+        return ERROR_OUT_OF_MEM;
+    if ((LOCATION_OF(v1) & (PAGE_SIZE-1)) || (LOCATION_OF(v2) & (PAGE_SIZE-1)))
+        err |= ERROR_ALIGMENT;
+    if (LOCATION_OF(v2) >= LOCATION_OF(v1) || LOCATION_OF(v3) >= LOCATION_OF(v2))
+        err |= ERROR_NOT_FF;
+    
+    FreeSized(v1, 200000);
+    v4 = Malloc(150000);
+    if (v4 != v1)
+        err |= ERROR_NOT_FF;
+    
+    // With every span freed the small heap should be able to use all of M1 again
+    Free(v4);
+    Free(v2);
+    Free(v3);
+    SetLargeThreshold((size_t)-1);
+    v1 = Malloc((1<<20) - 16 - CANARY_SIZE);
+    if (!v1)
+        return err | ERROR_OUT_OF_MEM;
+    Free(v1);
+    SetLargeThreshold(DEFAULT_LARGE_THRESHOLD);
+    
+    // FreeSized takes the size each kind of block was asked for, and the hardened build stops on any other
+    v1 = Malloc(100);
+    v2 = MallocAligned(100, 64);
+    v3 = MallocAligned(40, PAGE_SIZE);
+    v4 = Malloc(200000);
+    if (!v1 || !v2 || !v3 || !v4)
+        return err | ERROR_OUT_OF_MEM;
+    FreeSized(v1, 100);
+    FreeSized(v2, 100);
+    FreeSized(v3, 40);
+    FreeSized(v4, 200000);
+    if (VerifyHeap() || curPointer != basePointer + 4)
+        err |= ERROR_NOT_FF;
+#ifdef HEAP_DEBUG
+    fprintf(stderr, "Expect a report of a FreeSized with the wrong size:\n");
+    fflush(stderr);
+    pid = fork();
+    if (pid == 0){
+        FreeSized(Malloc(100), 200);
+        _exit(0);
+    }
+    waitpid(pid, &status, 0);
+    if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGABRT)
+        err |= ERROR_DATA_INCON;
+#endif
+    return err;
+}
+
+
+int test_aligned(void){
+    // Each block should start on its alignment, keep its data, and give all of its space back when freed
+    addrs_t allocs[10];
+    size_t align;
+    int i, err = 0;
+    
+    Close(); // Done with the heap used by the earlier tests
+    Init(1<<20);
+    Malloc(4); // Put the heap off any large alignment
+    for (i = 0, align = 16; align <= PAGE_SIZE; i++, align <<= 1){
+        allocs[i] = MallocAligned(100 + i, align);
+        if (!allocs[i])
+            return ERROR_OUT_OF_MEM;
+        if (LOCATION_OF(allocs[i]) & (align-1))
+            err |= ERROR_ALIGMENT;
+        memset(allocs[i], 'a' + i, 100 + i);
+    }
+    allocs[i] = MallocAligned(200000, PAGE_SIZE); // A large object
+    if (!allocs[i] || (LOCATION_OF(allocs[i]) & (PAGE_SIZE-1)))
+        err |= ERROR_ALIGMENT;
+    
+    for (i = 0, align = 16; align <= PAGE_SIZE; i++, align <<= 1){
+        if (allocs[i][0] != 'a' + i || allocs[i][99 + i] != 'a' + i)
+            err |= ERROR_DATA_INCON;
+        Free(allocs[i]);
+    }
+    Free(allocs[i]);
+
+    // Sizes that would wrap when rounded up or cut to a 32 bit tag must fail, not become tiny blocks
+    if (Malloc(SIZE_MAX) || Malloc(0xfffffffc) || MallocAligned(SIZE_MAX - 8, 64) || MallocAligned(0xfffffff0, 64))
+        err |= ERROR_DATA_INCON;
+
+    if (MallocAligned(8, 3) || Malloc(1000) != basePointer + 24 + CANARY_SIZE) // Only the first block should be left
+        err |= ERROR_NOT_FF;
+    return err;
+}
+
 
+int test_verify(void){
+    // A heap used normally should verify cleanly, and a damaged footer should be reported
+    addrs_t v1, v2, v3;
+    unsigned int saved;
+    int err = 0;
+    
+    Close(); // Done with the heap used by the earlier tests
+    Init(1<<20);
+    v1 = Malloc(40);
+    v2 = Malloc(200000);
+    v3 = Malloc(24);
+    Free(v1);
+    SetDeferredCoalescing(1);
+    Free(v3);
+    if (VerifyHeap())
+        err |= ERROR_DATA_INCON;
+    SetDeferredCoalescing(0);
+    Free(v2);
+    if (VerifyHeap())
+        err |= ERROR_DATA_INCON;
+
+    v2 = Malloc(200000); // The first span sits at the top of M1, and free it is fine there
+    v3 = Malloc(200000);
+    Free(v2);
+    if (!v3 || VerifyHeap())
+        err |= ERROR_DATA_INCON;
+    Free(v3);
+    if (VerifyHeap())
+        err |= ERROR_DATA_INCON;
+
+    v1 = Malloc(16);
+    saved = *(unsigned int *)(v1 + 16 + CANARY_SIZE);
+    *(unsigned int *)(v1 + 16 + CANARY_SIZE) = 0; // Overwrite the footer, as a stray write would
+    fprintf(stderr, "Expect a report of a damaged block from VerifyHeap:\n");
+    if (!VerifyHeap())
+        err |= ERROR_DATA_INCON;
+    *(unsigned int *)(v1 + 16 + CANARY_SIZE) = saved;
+    Free(v1);
+    return err;
+}
+
+
+int test_iovec(void){
+    // A frame put together from pieces should come back whole, and Get should copy all of one block and no more
+    char head[6] = "head:", body[3000], tail[6] = ":tail";
+    char out1[4], out2[3005], out3[20];
+    struct iovec in[3] = {{head, 5}, {body, sizeof(body)}, {tail, 5}};
+    struct iovec out[3] = {{out1, sizeof(out1)}, {out2, sizeof(out2)}, {out3, sizeof(out3)}};
+    addrs_t v1;
+    char name[32];
+    size_t offset = 0, copied;
+    int ready[2], sent[2], status;
+    int err = 0;
+    pid_t pid;
+    
+    memset(body, 'b', sizeof(body));
+    v1 = PutV(in, 3);
+    if (!v1)
+        return ERROR_OUT_OF_MEM;
+    if (memcmp(v1, "head:", 5) || v1[5] != 'b' || v1[3004] != 'b' || memcmp(v1 + 3005, ":tail", 5))
+        err |= ERROR_DATA_INCON;
+    
+    memset(out3, 0, sizeof(out3));
+    copied = GetV(out, 3, v1);
+    if (copied < 3010 || copied > 3010 + 7 || out3[copied - 3009]) // The 3010 bytes put in, their padding and no more
+        err |= ERROR_DATA_INCON;
+    if (memcmp(out1, "head", 4) || out2[0] != ':' || out2[3000] != 'b' || memcmp(out2 + 3001, ":tai", 4) || out3[0] != 'l')
+        err |= ERROR_DATA_INCON;
+    
+    memset(out2, 0, sizeof(out2));
+    v1 = Put(body, 1000);
+    Get(out2, v1, sizeof(out2)); // Asking for more than the block holds must not touch the blocks after it
+    if (out2[999] != 'b' || out2[1000] || VerifyHeap())
+        err |= ERROR_DATA_INCON;
+    
+    v1 = Malloc(1<<18); // A large object, with no header to read the size from
+    if (!v1)
+        return ERROR_OUT_OF_MEM;
+    memset(v1, 'L', 1<<18);
+    memset(out2, 0, sizeof(out2));
+    Get(out2, v1, 2);
+    if (out2[0] != 'L' || out2[1] != 'L' || out2[2])
+        err |= ERROR_DATA_INCON;
+    if (VerifyHeap() || curPointer != basePointer + 4)
+        err |= ERROR_NOT_FF;
+    
+    // A process that attached to a shared heap before a large object was made there should still Get all of it
+    snprintf(name, sizeof(name), "/mheap_get_%d", (int)getpid());
+    shm_unlink(name);
+    Close();
+    if (InitShared(name, 1<<20) || pipe(ready) || pipe(sent))
+        return ERROR_OUT_OF_MEM;
+    pid = fork();
+    if (pid == 0){
+        Close();
+        if (InitShared(name, 0) || write(ready[1], "r", 1) != 1 || read(sent[0], &offset, sizeof(offset)) != sizeof(offset))
+            _exit(1);
+        memset(out2, 0, sizeof(out2));
+        Get(out2, AddrAt(offset), sizeof(out2));
+        _exit(out2[0] != 'L' || out2[sizeof(out2) - 1] != 'L');
+    }
+    if (read(ready[0], out1, 1) != 1 || !(v1 = Malloc(1<<18)))
+        err |= ERROR_OUT_OF_MEM;
+    else{
+        memset(v1, 'L', 1<<18);
+        offset = OffsetOf(v1);
+    }
+    if (write(sent[1], &offset, sizeof(offset)) != sizeof(offset))
+        err |= ERROR_OUT_OF_MEM;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+        err |= ERROR_DATA_INCON;
+    lockHeap();
+    if (VerifyHeap() || spanPointer != basePointer + memSize) // The child's Get freed the object
+        err |= ERROR_NOT_FF;
+    unlockHeap();
+    close(ready[0]);
+    close(ready[1]);
+    close(sent[0]);
+    close(sent[1]);
+    Close();
+    shm_unlink(name);
+    Init(1<<20);
+    return err;
+}
+
+
+int test_heapmap(void){
+    // Freeing every other block should show up in the map as holes, with a fragmentation index to match
+    addrs_t v[8], big;
+    char line[128];
+    FILE* map;
+    int i, freeRows = 0, allocRows = 0, largeRows = 0, err = 0;
+    double index = -1;
+    
+    Close();
+    Init(1<<20);
+    for (i = 0; i < 8; i++)
+        if (!(v[i] = Malloc(100)))
+            return ERROR_OUT_OF_MEM;
+    big = Malloc(1<<18);
+    for (i = 0; i < 8; i += 2)
+        Free(v[i]);
+    
+    map = tmpfile();
+    if (!map || DumpHeapMap(map))
+        return ERROR_OUT_OF_MEM;
+    rewind(map);
+    while (fgets(line, sizeof(line), map)){
+        freeRows += strstr(line, ",free,") != NULL;
+        allocRows += strstr(line, ",alloc,") != NULL;
+        largeRows += strstr(line, ",large,") != NULL;
+        sscanf(line, "# fragmentation index %lf", &index);
+    }
+    fclose(map);
+    if (freeRows != 4 || allocRows != 4 || largeRows != 1)
+        err |= ERROR_DATA_INCON;
+    if (index <= 0 || index >= 1)
+        err |= ERROR_DATA_INCON;
+    
+    for (i = 1; i < 8; i += 2)
+        Free(v[i]);
+    Free(big);
+    if (VerifyHeap() || curPointer != basePointer + 4)
+        err |= ERROR_NOT_FF;
+
+    // A heap full of the smallest blocks there are should still fit in the map, one row each
+    Close();
+    Init(1<<16);
+    for (i = 0; Malloc(0); i++)
+        ;
+    map = tmpfile();
+    if (!map || DumpHeapMap(map))
+        return ERROR_OUT_OF_MEM;
+    rewind(map);
+    allocRows = 0;
+    while (fgets(line, sizeof(line), map))
+        allocRows += strstr(line, ",alloc,") != NULL;
+    fclose(map);
+    if (allocRows != i || VerifyHeap())
+        err |= ERROR_DATA_INCON;
+    Close();
+    Init(1<<20); // Back to the size the later tests expect
+    return err;
+}
+
+
+/* Allocates from a stack of its own, so the profile has a site to find */
+static addrs_t __attribute__((noinline)) profiledSite(size_t size){
+    return Malloc(size);
+}
+
+int test_profile(void){
+    // With a small sample rate nearly every block is sampled, and freeing them should empty the in use totals
+    addrs_t v[64];
+    char line[256];
+    long int inuseObjects = -1, inuseBytes, allocObjects = -1, allocBytes;
+    FILE* profile;
+    int i, maps = 0, err = 0;
+    
+    SetSampleRate(64);
+    for (i = 0; i < 64; i++)
+        if (!(v[i] = (i % 8) ? profiledSite(1000) : MallocAligned(1000, 64)))
+            return ERROR_OUT_OF_MEM;
+    v[0] = (Free(v[0]), profiledSite(200000)); // One large object too
+    for (i = 0; i < 64; i += 2)
+        Free(v[i]);
+    
+    profile = tmpfile();
+    if (!profile || DumpHeapProfile(profile))
+        return ERROR_OUT_OF_MEM;
+    rewind(profile);
+    if (!fgets(line, sizeof(line), profile) || sscanf(line, "heap profile: %ld: %ld [%ld: %ld] @ heap_v2/64", &inuseObjects, &inuseBytes, &allocObjects, &allocBytes) != 4)
+        err |= ERROR_DATA_INCON;
+    while (fgets(line, sizeof(line), profile))
+        maps |= !strcmp(line, "MAPPED_LIBRARIES:\n");
+    fclose(profile);
+    if (inuseObjects < 24 || inuseObjects > 32 || allocObjects < 50 || inuseBytes > 32*1000 || !maps)
+        err |= ERROR_DATA_INCON;
+    
+    for (i = 1; i < 64; i += 2)
+        Free(v[i]);
+    if (liveSampleCount || VerifyHeap())
+        err |= ERROR_DATA_INCON;
+    SetSampleRate(0);
+    return err;
+}
+
+
+/* Fills a heap of heapSize bytes with 5000 byte blocks and frees them in address order, so each Free joins the hole
+ the ones before it left. Returns the fewest clock cycles a Free took on average over three passes. */
+static unsigned long freeCycles(size_t heapSize){
+    addrs_t* blocks = malloc(heapSize/5000*sizeof(addrs_t));
+    unsigned long start, finish, total, best = ULONG_MAX;
+    size_t n, i;
+    int pass;
+    
+    Close();
+    Init(heapSize);
+    for (pass = 0; pass < 3 && blocks; pass++){
+        for (n = 0; n < heapSize/5000 && (blocks[n] = Malloc(5000 - 8 - CANARY_SIZE)); n++)
+            ;
+        total = 0;
+        for (i = 0; i + 1 < n; i++){ // The last block keeps the hole from folding into the end of the heap
+            rdtsc(&start);
+            Free(blocks[i]);
+            rdtsc(&finish);
+            total += finish - start;
+        }
+        Free(blocks[n - 1]);
+        if (n > 1 && total/(n - 1) < best)
+            best = total/(n - 1);
+    }
+    free(blocks);
+    return best;
+}
+
+int test_freeScaling(void){
+    // A Free that joins a hole should not cost more as the hole grows: 16 times the blocks, about the same per Free
+    unsigned long small, big;
+    int err = 0;
+    
+    SetDeferredCoalescing(0);
+    small = freeCycles(1<<20);
+    big = freeCycles(1<<24);
+    printf("Average clock cycles per Free: %lu with 1 MB of holes, %lu with 16 MB\n", small, big);
+    if (small == ULONG_MAX || big == ULONG_MAX)
+        err |= ERROR_OUT_OF_MEM;
+    else if (big > 6*small) // Rewriting the bits of the whole hole made it 9 to 16 times; cache misses alone stay under 3
+        err |= ERROR_NOT_FF;
+    if (VerifyHeap() || curPointer != basePointer + 4)
+        err |= ERROR_DATA_INCON;
+    Close();
+    Init(1<<20);
+    return err;
+}
+#endif
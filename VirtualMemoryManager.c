@@ -5,6 +5,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <execinfo.h>
+#include <errno.h>
+#include <pthread.h>
 
 /*Variables developed from TF test code in order to evaluate our heap */
 #define KBLU  "\x1B[34m"
@@ -15,10 +26,10 @@
 #define ERROR_DATA_INCON    0x2
 #define ERROR_ALIGMENT      0x4
 #define ERROR_NOT_FF        0x8
-#define LOCATION_OF(addr)     ((size_t)(*addr))
+#define LOCATION_OF(addr)     ((size_t)VADDR(addr))
 #define DATA_OF(addr)         (*(addr))
 
-#define rdtsc(x)      __asm__ __volatile__("rdtsc \n\t" : "=A" (*(x)))
+#define rdtsc(x)      do { unsigned int lo_, hi_; __asm__ __volatile__("rdtsc \n\t" : "=a" (lo_), "=d" (hi_)); *(x) = ((unsigned long)hi_ << 32) | lo_; } while (0)
 
 #define DEFAULT_MEM_SIZE 1<<20
 
@@ -27,16 +38,97 @@
 #define DEFAULT_MEM_SIZE 1<<20
 #define R 1<<20
 
+/* The region holds a header page, the redirection table and then the heap, each starting on a page boundary */
+#define PAGE_SIZE 4096
+#define PAGE_ALIGNED(size) (((size) + (PAGE_SIZE-1)) & ~(size_t)(PAGE_SIZE-1))
+#define IMAGE_MAGIC 0x50494856 //"VHIP" - virtual heap image
+#define IMAGE_VERSION 3
+
+/* Building with -DHEAP_DEBUG ends every block with a canary, poisons the space VFree gives back and stops on
+ double or stray VFrees. VerifyHeap() is there in every build. */
+#ifdef HEAP_DEBUG
+#define CANARY_SIZE 8
+#else
+#define CANARY_SIZE 0
+#endif
+#define CANARY_OF(h) (0x5ca1ab1edeadbeefULL ^ (uint64_t)(h)) //by handle, since blocks slide down
+#define POISON_BYTE 0xdd
+
+/* The sampling profiler records the stack of about one in every sampleRate bytes VMalloc'd, keyed by handle */
+#define SAMPLE_DEPTH 32 //frames kept per stack
+#define SAMPLE_SITES 1024 //distinct stacks kept
+#define SAMPLE_SLOTS 4096 //sampled blocks that can be live at once, a power of two
+
+/* Address of the data a handle refers to. Only valid until the next VFree, which may slide the block down. */
+#define VADDR(h)      (basePointer + RT[(h)])
+
 /* Types used throughout code */
 typedef char* addrs_t;
 typedef void* any_t;
+typedef size_t handle_t; //index into the redirection table. 0 is never handed out and means failure.
+
+/* Header at the start of the region. Every link after it is an offset so the region can be mapped at any address. */
+struct vheapHeader {
+    unsigned int magic;
+    unsigned int version;
+    size_t memSize; //size of the heap area in bytes
+    size_t tableSize; //number of entries in the redirection table
+    size_t tableOffset; //offset of the redirection table from the start of the region
+    size_t heapOffset; //offset of the heap from the start of the region
+    size_t curOffset; //end of the allocated area, relative to the start of the heap
+    handle_t tableEnd; //one past the highest handle in use
+    long int allocatedBlocks; //heapChecker totals, kept so they survive a restart
+    long int rawTotalAllocated;
+    long int paddedTotalAllocated;
+    long int alignedBlocks; //blocks from VMallocAligned. VFree only has to realign moved blocks while there are any
+    pthread_mutex_t lock; //process-shared, robust and recursive. only taken when the region is shared.
+    int unusable; //set when a process died holding the lock and left the heap damaged. every call fails from then on.
+};
+
+/* Allocations sampled from one call stack. The in use totals drop again as the sampled blocks are freed. */
+struct sampleSite {
+    uint64_t hash; //of the stack, 0 while the site is unused
+    int depth;
+    void* stack[SAMPLE_DEPTH];
+    long int inuseObjects;
+    long int inuseBytes;
+    long int allocObjects;
+    long int allocBytes;
+};
+
+/* A sampled block that has not been freed yet */
+struct liveSample {
+    handle_t handle; //0 while the slot is empty
+    size_t size; //bytes asked for
+    int site; //index into sampleSites
+};
+
+/* One row of a heap map. DumpHeapMap fills these in with the heap locked and writes them out once it is unlocked. */
+struct mapEntry {
+    size_t offset; //of the block's header from basePointer
+    size_t size; //bytes taken from the heap, header and footer included
+    handle_t handle; //0 if no handle refers to the block
+};
 
 /* prototypes for included functions are below */
 void VInit(size_t);
-addrs_t* VMalloc (size_t size);
-void VFree (addrs_t* addr);
-addrs_t* VPut (any_t data, size_t size);
-void VGet (any_t return_data, addrs_t* addr, size_t size);
+int VInitImage(const char* path, size_t size);
+int VInitShared(const char* name, size_t size);
+int VLock(void);
+void VUnlock(void);
+void VSync(void);
+void VClose(void);
+handle_t VMalloc (size_t size);
+handle_t VMallocAligned (size_t size, size_t align);
+void VFree (handle_t addr);
+handle_t VPut (any_t data, size_t size);
+handle_t VPutV (const struct iovec* iov, int iovcnt);
+void VGet (any_t return_data, handle_t addr, size_t size);
+size_t VGetV (const struct iovec* iov, int iovcnt, handle_t addr);
+int VerifyHeap(void);
+int DumpHeapMap(FILE* out);
+void SetSampleRate(size_t bytes);
+int DumpHeapProfile(FILE* out);
 void heapChecker(void);
 void PrintAddrs(void);
 int test_stability(int, unsigned long*, unsigned long*);
@@ -44,13 +136,26 @@ int test_ff(void);
 int test_maxNumOfAlloc(void);
 int test_maxSizeOfAlloc(int);
 void print_testResult(int);
+int test_image(void);
+int test_shared(void);
+int test_aligned(void);
+int test_verify(void);
+int test_iovec(void);
+int test_heapmap(void);
+int test_profile(void);
 
 
-static addrs_t RT[R]; //redirection table static array. made up of pointers to the memory heap.
+static size_t* RT; //redirection table. made up of offsets from basePointer to the data of each block, 0 for an unused entry.
+static size_t tableSize; //number of entries in the redirection table.
 static addrs_t basePointer; //pointer to base address of the heap.
 static addrs_t curPointer; //pointer to the end of the allocated memory in the virtual memory heap.
 static size_t memSize; //memory size of heap
-static addrs_t* tableEndPointer; //pointer to the current "end" in the redirection table, updated during each allocation.
+static handle_t tableEnd; //the current "end" in the redirection table, updated during each allocation.
+
+static struct vheapHeader* header; //start of the region holding the header, table and heap.
+static size_t regionLength; //total bytes in the region.
+static int regionFd = -1; //file descriptor of the backing image or shared memory object, -1 if the region came from malloc.
+static int sharedRegion = 0; //set when other processes may be using the region at the same time.
 
 
 /*static variables needed for heapChecker */
@@ -63,6 +168,17 @@ static long int allocatedBlocks = 0;
 static long int freeBlocks = 1;
 static long int rawTotalFree; //variable to count the raw total memory free
 static long int paddedTotalFree;
+static long int alignedBlocks = 0; //variable to count the blocks from VMallocAligned
+
+/*static variables needed for the sampling profiler. samples belong to this process, even when the heap is shared. */
+static long int sampleCountdown = LONG_MAX; //bytes left until the next sample. VMalloc only subtracts from it
+static size_t sampleRate; //mean bytes between samples, 0 while the profiler is off
+static uint64_t sampleSeed = 0x9e3779b97f4a7c15ULL; //xorshift state for drawing the intervals
+static int sampling; //set while a stack is taken, so anything backtrace() allocates is not sampled
+static struct sampleSite sampleSites[SAMPLE_SITES];
+static struct liveSample liveSamples[SAMPLE_SLOTS]; //open addressing on the handle, linear probing
+static long int liveSampleCount;
+static long int droppedSamples; //samples lost because a table was full
 
 
 int main(int argc, char **argv){
@@ -119,8 +235,102 @@ int main(int argc, char **argv){
      heapChecker();
      */
     
+    /* TEST 5: HEAP IMAGE RESTART */
+    printf("Test 5 - Heap image warm restart:\n");
+    print_testResult(test_image());
+    
+    /* TEST 6: SHARED MEMORY */
+    printf("\nTest 6 - Shared memory between processes:\n");
+    print_testResult(test_shared());
+    
+    /* TEST 7: ALIGNED ALLOCATION */
+    printf("\nTest 7 - Aligned allocations:\n");
+    print_testResult(test_aligned());
+    
+    /* TEST 8: HEAP VERIFIER */
+    printf("\nTest 8 - Heap verifier:\n");
+    print_testResult(test_verify());
     
+    /* TEST 9: SCATTER-GATHER */
+    printf("\nTest 9 - VGet and scatter-gather copies:\n");
+    print_testResult(test_iovec());
     
+    /* TEST 10: HEAP MAP */
+    printf("\nTest 10 - Heap map:\n");
+    print_testResult(test_heapmap());
+    
+    /* TEST 11: SAMPLING PROFILER */
+    printf("\nTest 11 - Sampling profiler:\n");
+    print_testResult(test_profile());
+    
+}
+
+/* Bytes needed for the header, a full redirection table and a heap of size bytes */
+static size_t regionSizeFor(size_t size){
+    return PAGE_SIZE + PAGE_ALIGNED(sizeof(size_t) * (R)) + PAGE_ALIGNED(size);
+}
+
+/* Sets up the header lock so it can be shared between processes and survives a holder that dies */
+static void initLock(struct vheapHeader* h){
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE); //VPut and VGet call VMalloc and VFree with the lock held.
+    pthread_mutex_init(&h->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* Lays out an empty heap in a zeroed region */
+static void formatRegion(addrs_t region, size_t size){
+    struct vheapHeader* h = (struct vheapHeader*) region;
+    h->version = IMAGE_VERSION;
+    h->memSize = size;
+    h->tableSize = R;
+    h->tableOffset = PAGE_SIZE;
+    h->heapOffset = PAGE_SIZE + PAGE_ALIGNED(sizeof(size_t) * (R));
+    h->curOffset = 4; //leave room for the 4 byte base header.
+    h->tableEnd = 1; //handle 0 is reserved so it can be returned on failure.
+    h->allocatedBlocks = 0;
+    h->rawTotalAllocated = 0;
+    h->paddedTotalAllocated = 0;
+    h->alignedBlocks = 0;
+    initLock(h);
+    __atomic_store_n(&h->magic, IMAGE_MAGIC, __ATOMIC_RELEASE); //last, so a process attaching to shared memory never sees half a header.
+}
+
+/* Reads the end of heap and table back from the header. Another process may have moved them since we last looked. */
+static void loadState(void){
+    curPointer = basePointer + header->curOffset;
+    tableEnd = header->tableEnd;
+    
+    allocatedBlocks = header->allocatedBlocks;
+    rawTotalAllocated = header->rawTotalAllocated;
+    paddedTotalAllocated = header->paddedTotalAllocated;
+    alignedBlocks = header->alignedBlocks;
+    rawTotalFree = memSize - 4 - rawTotalAllocated;
+    paddedTotalFree = memSize - paddedTotalAllocated;
+}
+
+/* Points the static variables at a formatted region. Nothing in the table or heap is touched, so this is O(1). */
+static void attachRegion(addrs_t region, size_t length){
+    header = (struct vheapHeader*) region;
+    regionLength = length;
+    RT = (size_t*) (region + header->tableOffset);
+    tableSize = header->tableSize;
+    basePointer = region + header->heapOffset;
+    memSize = header->memSize;
+    loadState();
+}
+
+/* Writes the end of heap and table back into the header after every change so the region is always a valid image */
+static void publishState(void){
+    header->curOffset = curPointer - basePointer;
+    header->tableEnd = tableEnd;
+    header->allocatedBlocks = allocatedBlocks;
+    header->rawTotalAllocated = rawTotalAllocated;
+    header->paddedTotalAllocated = paddedTotalAllocated;
+    header->alignedBlocks = alignedBlocks;
 }
 
 void VInit(size_t size){
@@ -130,54 +340,355 @@ void VInit(size_t size){
      */
     
     /* add other initializations as needed */
-    basePointer = (addrs_t) malloc (size); //set the static basePointer variable to track the virtual address to the start of the heap
-    memSize = size;     // set the static memsize variable to track when the heap is full.
-    curPointer = basePointer + 4; //set the pointer for the end of the allocated virtual memory to be the start of the v-heap.
-    tableEndPointer = &RT; //initialize the table pointer to be the start of the redirection table.
-    rawTotalFree = size - 4; //Set both to size of the data into the global variables that calculate the free space
-    paddedTotalFree = size; // subtract 4 for the base header also.
+    size_t length = regionSizeFor(size);
+    addrs_t region = (addrs_t) calloc (1, length); //one block for the header, redirection table and heap.
+    formatRegion(region, size);
+    attachRegion(region, length); //sets basePointer, curPointer, RT and the table end from the header.
+    regionFd = -1;
+}
+
+/* Maps the region held by fd, formatting it as an empty heap of size bytes if the file is new.
+ Returns the region or NULL, closing fd on failure. */
+static addrs_t mapRegion(int fd, size_t size, size_t* length){
+    struct stat st;
+    struct vheapHeader* h;
+    addrs_t region;
+    int fresh;
+    
+    if (fstat(fd, &st) < 0){
+        close(fd);
+        return NULL;
+    }
+    
+    fresh = (st.st_size == 0);
+    *length = fresh ? regionSizeFor(size) : (size_t) st.st_size;
+    if (fresh && ftruncate(fd, *length) < 0){ //the new file reads back as zeros, which is an empty table.
+        close(fd);
+        return NULL;
+    }
+    if (*length < PAGE_SIZE){ //too short to hold a header
+        close(fd);
+        return NULL;
+    }
+    
+    region = (addrs_t) mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED){
+        close(fd);
+        return NULL;
+    }
+    
+    h = (struct vheapHeader*) region;
+    if (fresh){
+        formatRegion(region, size);
+        return region;
+    }
+    
+    while (sharedRegion && __atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) == 0){ //the creating process is still formatting.
+        usleep(1000);
+    }
+    if (h->magic != IMAGE_MAGIC || h->version != IMAGE_VERSION || regionSizeFor(h->memSize) != *length || h->unusable){
+        munmap(region, *length); //not one of our images, or one left damaged, leave it alone.
+        close(fd);
+        return NULL;
+    }
+    return region;
+}
+
+int VInitImage(const char* path, size_t size){
+    /* Maps the heap image at path, creating an empty heap of size bytes if the file is new or empty.
+     An existing image keeps its own size and every handle in it stays valid. Returns 0 on success, -1 on failure.
+     */
+    size_t length;
+    addrs_t region;
+    
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return -1;
+    
+    sharedRegion = 0;
+    region = mapRegion(fd, size, &length);
+    if (region == NULL)
+        return -1;
+    initLock((struct vheapHeader*) region); //an image has a single user, drop any lock state left by the last one.
+    
+    attachRegion(region, length);
+    regionFd = fd;
+    return 0;
+}
+
+int VInitShared(const char* name, size_t size){
+    /* Places the header, table and heap in the POSIX shared memory object name, creating an empty heap of size bytes
+     if nobody has yet. Every process that attaches sees the same handles; VMalloc, VFree, VPut and VGet take the
+     shared lock, and code that reads through VADDR directly should hold VLock() so a VFree elsewhere cannot slide
+     the data. VLock() returns -1 instead once a process has died holding the lock and left the heap damaged.
+     The heapChecker request counts stay per process. Returns 0 on success, -1 on failure.
+     */
+    size_t length;
+    addrs_t region;
+    
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST){
+        fd = shm_open(name, O_RDWR, 0600);
+        while (fd >= 0 && lseek(fd, 0, SEEK_END) == 0){ //created but not yet sized by its creator.
+            usleep(1000);
+        }
+    }
+    if (fd < 0)
+        return -1;
+    
+    sharedRegion = 1;
+    region = mapRegion(fd, size, &length);
+    if (region == NULL){
+        sharedRegion = 0;
+        return -1;
+    }
+    
+    attachRegion(region, length);
+    regionFd = fd;
+    return 0;
+}
+
+int VLock(void){
+    /* Takes the shared lock and picks up any changes other processes made. Does nothing unless the region is shared.
+     Returns 0, or -1 without the lock if the heap was left damaged by a process that died holding it. */
+    int rc;
+    
+    if (!sharedRegion)
+        return 0;
+    rc = pthread_mutex_lock(&header->lock);
+    if (rc != 0 && rc != EOWNERDEAD)
+        return -1;
+    loadState();
+    if (rc == EOWNERDEAD){
+        /* The holder died. The header only has what its last finished call published, and it may have been half way
+         through moving blocks or the table, so the heap is checked before anyone carries on. */
+        pthread_mutex_consistent(&header->lock);
+        if (!header->unusable && VerifyHeap()){
+            fprintf(stderr, "VLock: a process died holding the lock and left the heap damaged. it can no longer be used\n");
+            header->unusable = 1;
+        }
+    }
+    if (header->unusable){
+        pthread_mutex_unlock(&header->lock);
+        return -1;
+    }
+    return 0;
+}
+
+void VUnlock(void){
+    if (!sharedRegion)
+        return;
+    pthread_mutex_unlock(&header->lock);
+}
+
+void VSync(void){
+    /* Flushes the image to its file. The header is already current, so a copy of the file is a valid heap. */
+    if (VLock())
+        return;
+    publishState();
+    if (regionFd >= 0)
+        msync(header, regionLength, MS_SYNC);
+    VUnlock();
+}
+
+void VClose(void){
+    /* Releases the region. An image is flushed first so the next VInitImage on it can continue where we left off. */
+    VSync();
+    if (regionFd >= 0){
+        munmap(header, regionLength); //a shared memory object stays behind for the other processes until shm_unlink.
+        close(regionFd);
+        regionFd = -1;
+        sharedRegion = 0;
+    }
+    else {
+        free(header);
+    }
+    header = NULL;
+    RT = NULL;
+    basePointer = curPointer = NULL;
+    
+    /* the blocks sampled are gone with the heap, but what was allocated from each stack still counts */
+    memset(liveSamples, 0, sizeof(liveSamples));
+    liveSampleCount = 0;
+    for (int i = 0; i < SAMPLE_SITES; i++){
+        sampleSites[i].inuseObjects = 0;
+        sampleSites[i].inuseBytes = 0;
+    }
+}
+
+
+#ifdef HEAP_DEBUG
+/* Reports a bug found by the hardened build and stops before it can do more damage */
+static void heapCorruption(const char* what, handle_t h){
+    fprintf(stderr, "%sheap corruption%s: %s, handle %zu\n", KRED, KRESET, what, h);
+    abort();
+}
+#endif
+
+static addrs_t blockHeader(addrs_t data);
+
+/* Writes the canary at the end of the block a handle refers to. Needed again whenever its data is moved. */
+static void armBlock(handle_t h){
+#ifdef HEAP_DEBUG
+    addrs_t block = blockHeader(VADDR(h));
+    *(uint64_t *)(block + 4 + ((*(unsigned int *)block) & ~0x7) - CANARY_SIZE) = CANARY_OF(h);
+#endif
+}
+
+/* log2 of x > 0 to about 1e-5 from its exponent and an atanh series for the mantissa, so the profiler needs no libm */
+static double fastLog2(double x){
+    union { double d; uint64_t u; } bits = { x };
+    int exponent = (int) ((bits.u >> 52) & 0x7ff) - 1023;
+    double z, z2;
+    
+    bits.u = (bits.u & ~(0x7ffULL << 52)) | (1023ULL << 52); //the mantissa alone, in [1, 2)
+    z = (bits.d - 1)/(bits.d + 1);
+    z2 = z*z;
+    return exponent + 2.8853900817779268*z*(1 + z2*(1.0/3 + z2*(1.0/5 + z2*(1.0/7)))); //2/ln 2 * atanh(z)
+}
+
+/* Bytes until the next sample, drawn from an exponential distribution with mean sampleRate as tcmalloc does */
+static long int nextSampleInterval(void){
+    double u;
+    if (!sampleRate)
+        return LONG_MAX;
+    sampleSeed ^= sampleSeed << 13;
+    sampleSeed ^= sampleSeed >> 7;
+    sampleSeed ^= sampleSeed << 17;
+    u = (double) ((sampleSeed >> 11) + 1)/9007199254740992.0; //in (0, 1]
+    return (long int) (-fastLog2(u)*0.6931471805599453*sampleRate) + 1;
+}
+
+/* Slot of the live sample for handle h, or the empty slot where it would go */
+static size_t sampleSlot(handle_t h){
+    size_t slot = h & (SAMPLE_SLOTS - 1);
+    while (liveSamples[slot].handle && liveSamples[slot].handle != h)
+        slot = (slot + 1) & (SAMPLE_SLOTS - 1);
+    return slot;
+}
+
+/* Takes the sample for handle h, if this process has one, out of the in use totals */
+static void dropSample(handle_t h){
+    size_t slot = sampleSlot(h), next, home;
+    
+    if (!liveSamples[slot].handle)
+        return;
+    sampleSites[liveSamples[slot].site].inuseObjects--;
+    sampleSites[liveSamples[slot].site].inuseBytes -= liveSamples[slot].size;
+    liveSampleCount--;
+    
+    /* close the gap so the samples after it can still be found, moving back any whose probe started at or before it */
+    for (next = (slot + 1) & (SAMPLE_SLOTS - 1); liveSamples[next].handle; next = (next + 1) & (SAMPLE_SLOTS - 1)){
+        home = liveSamples[next].handle & (SAMPLE_SLOTS - 1);
+        if (((next - home) & (SAMPLE_SLOTS - 1)) >= ((next - slot) & (SAMPLE_SLOTS - 1))){
+            liveSamples[slot] = liveSamples[next];
+            slot = next;
+        }
+    }
+    liveSamples[slot].handle = 0;
 }
 
+/* Records the stack of a block whose bytes ran the countdown out. Kept out of line so VMalloc stays small. */
+static void __attribute__((noinline)) sampleBlock(handle_t h, size_t size){
+    void* stack[SAMPLE_DEPTH + 2];
+    uint64_t hash = 14695981039346656037ULL;
+    int depth, i, site;
+    size_t slot;
+    
+    sampleCountdown = nextSampleInterval();
+    if (sampling || !sampleRate || h == 0)
+        return;
+    if (liveSampleCount >= SAMPLE_SLOTS/2){ //keep the probes short.
+        droppedSamples++;
+        return;
+    }
+    
+    sampling = 1;
+    depth = backtrace(stack, SAMPLE_DEPTH + 2) - 2; //leave out sampleBlock and VMalloc.
+    sampling = 0;
+    if (depth < 0)
+        depth = 0;
+    for (i = 0; i < depth; i++)
+        hash = (hash ^ (uintptr_t) stack[i + 2])*1099511628211ULL; //FNV-1a over the return addresses
+    hash |= 1;
+    
+    site = hash % SAMPLE_SITES;
+    for (i = 0; i < SAMPLE_SITES && sampleSites[site].hash && sampleSites[site].hash != hash; i++)
+        site = (site + 1) % SAMPLE_SITES;
+    if (i == SAMPLE_SITES){
+        droppedSamples++;
+        return;
+    }
+    if (!sampleSites[site].hash){
+        sampleSites[site].hash = hash;
+        sampleSites[site].depth = depth;
+        memcpy(sampleSites[site].stack, stack + 2, depth*sizeof(void*));
+    }
+    sampleSites[site].inuseObjects++;
+    sampleSites[site].inuseBytes += size;
+    sampleSites[site].allocObjects++;
+    sampleSites[site].allocBytes += size;
+    
+    slot = sampleSlot(h);
+    if (liveSamples[slot].handle){ //a stale sample, left when another process sharing the heap freed the block.
+        dropSample(h);
+        slot = sampleSlot(h);
+    }
+    liveSamples[slot].handle = h;
+    liveSamples[slot].size = size;
+    liveSamples[slot].site = site;
+    liveSampleCount++;
+}
 
-addrs_t* VMalloc(size_t size){
+handle_t VMalloc(size_t size){
     /*Virtualized Malloc implementation */
     
-    unsigned int alignedSize = ALIGNED(size);
+    unsigned int alignedSize; //block tags are 32 bit, so a size is only cut down to this once it is known to fit.
+    if (VLock()){
+        reqfailCount++;
+        return 0;
+    }
     
     //Checks to see if size requested can fit into the Heap
-    if (alignedSize > memSize){
+    if (size > memSize || ALIGNED(size) + CANARY_SIZE > memSize){
         reqfailCount++;
-        return NULL;
+        VUnlock();
+        return 0;
     }
+    alignedSize = ALIGNED(size) + CANARY_SIZE;
     
-    addrs_t* tableIndex = &RT; //set a search table pointer to find the end of the allocated
-    addrs_t RTentry; //value to be added to the redirection table.
+    handle_t tableIndex = 1; //set a search table index to find the end of the allocated
     
-    if ((curPointer+size) >= (basePointer+memSize)){ //only one contiguous block of memory, so therefore only free space is at the end of the heap.
+    if ((curPointer + alignedSize + 8) > (basePointer+memSize)){ //only one contiguous block of memory, so therefore only free space is at the end of the heap.
         reqfailCount++;
-        return NULL;
+        VUnlock();
+        return 0;
+    }
+    
+    /*Looks through table for an empty space if there is none just extends the table */
+    while(tableIndex!=tableEnd && RT[tableIndex]!=0){
+        tableIndex++;
+    }
+    
+    if (tableIndex == tableSize){ //every entry in the table is in use.
+        reqfailCount++;
+        VUnlock();
+        return 0;
     }
     
     /*Sets the header and footer of the block being allocated*/
     *(unsigned int*)curPointer = alignedSize;
     *(unsigned int*)(curPointer + alignedSize + 4)= alignedSize;
-    RTentry = curPointer + 4;
-    curPointer = curPointer + 8 + alignedSize; // increment current pointer to address the end of the allocated block
-    
-    
-    /*Looks through table for an empty space if there is none just extends the table
-     assumes tableEndPointer < actual memory address at the table end of the allocated space for the table */
-    while(tableIndex!=tableEndPointer && *tableIndex!=NULL){
-        tableIndex = (addrs_t*)((char*) tableIndex + sizeof(addrs_t));
-    }
     
-    /*assigns table pointer to heap pointer */
-    *(tableIndex) = RTentry; //fill redirection table with the address to the result of mallocing - type addrs_t.
+    /*assigns table entry to heap offset */
+    RT[tableIndex] = (curPointer + 4) - basePointer; //fill redirection table with the offset of the data from the start of the heap.
+    curPointer = curPointer + 8 + alignedSize; // increment current pointer to address the end of the allocated block
     
-    /*updates the pointer to the end of the redirection table if needed*/
-    if (tableIndex == tableEndPointer){
-        tableEndPointer = (addrs_t*) ((char*)tableEndPointer + sizeof(addrs_t*));//set the pointer to the end of the redirection table to be waiting for the next entry
+    /*updates the end of the redirection table if needed*/
+    if (tableIndex == tableEnd){
+        tableEnd++;
     }
+    armBlock(tableIndex);
     
     /*Increments global variables for HeapChecker */
     rawTotalAllocated += alignedSize;
@@ -186,67 +697,145 @@ addrs_t* VMalloc(size_t size){
     paddedTotalFree -= (alignedSize + 8);
     allocatedBlocks++;
     mallocCount++;
+    if ((sampleCountdown -= (long int) size) < 0)
+        sampleBlock(tableIndex, size);
+    publishState();
+    VUnlock();
     
-    /* returns address to the redirection table */
+    /* returns the handle into the redirection table */
     return tableIndex;
 }
 
 
-addrs_t* VPut(any_t data, size_t size){
+/* An aligned block is VMalloc'd align bytes bigger and its data placed at the first multiple of align at least
+ 8 bytes into it. Those 8 bytes hold how far in the data is and then align | 2. Headers never have bit 1 set,
+ so the word just before the data says which kind of block it is. */
+static addrs_t blockHeader(addrs_t data){
+    unsigned int word = *(unsigned int *)(data - 4);
+    if (word & 2)
+        return data - *(unsigned int *)(data - 8) - 4;
+    return data - 4;
+}
+
+/* Size of the data area the caller can use */
+static size_t dataSize(addrs_t data){
+    unsigned int word = *(unsigned int *)(data - 4);
+    size_t size = (*(unsigned int *)blockHeader(data)) & ~0x7;
+    return ((word & 2) ? size - (word & ~0x7) : size) - CANARY_SIZE;
+}
+
+/* Places the data of an aligned block on its alignment, moving it within the block if needed. Returns the offset to put in RT. */
+static size_t alignData(addrs_t header, addrs_t data, size_t align){
+    size_t size = (*(unsigned int *)header) & ~0x7;
+    addrs_t aligned = (addrs_t) (((uintptr_t) header + 12 + align - 1) & ~(uintptr_t) (align - 1));
+    if (aligned != data)
+        memmove(aligned, data, size - align);
+    *(unsigned int *)(aligned - 8) = (unsigned int) (aligned - header - 4);
+    *(unsigned int *)(aligned - 4) = (unsigned int) align | 2;
+    return aligned - basePointer;
+}
+
+handle_t VMallocAligned(size_t size, size_t align){
+    /* VMalloc whose data starts on a multiple of align, a power of two. VFree keeps it aligned when the block slides down. */
+    handle_t h;
+    
+    if (align == 0 || (align & (align - 1)) || size > memSize || align > memSize - size){ //before size + align can wrap.
+        reqfailCount++;
+        return 0;
+    }
+    if (align <= ALIGNMENT)
+        return VMalloc(size);
+    
+    if (VLock()){
+        reqfailCount++;
+        return 0;
+    }
+    h = VMalloc(ALIGNED(size) + align);
+    if (h){
+        RT[h] = alignData(VADDR(h) - 4, VADDR(h), align);
+        armBlock(h);
+        alignedBlocks++;
+        publishState();
+    }
+    VUnlock();
+    return h;
+}
+
+handle_t VPut(any_t data, size_t size){
     /* function to allocate data onto the heap */
     
-    addrs_t* RTpointer;
-    RTpointer = VMalloc(size); //pointer to the redirection table
-    //*RTpointer is equivalent to the address on the redirection table where the address to the memory must be copied to, not the memory itself
-    if (RTpointer == NULL){
-        return NULL;
+    handle_t RTindex;
+    if (VLock()) //hold the lock until the data is in place so no other process slides the block first.
+        return 0;
+    RTindex = VMalloc(size); //index into the redirection table
+    if (RTindex == 0){
+        VUnlock();
+        return 0;
     }
     
     /*Places data at location */
-    memcpy((void*)((*RTpointer)),data,size);
+    memcpy((void*)VADDR(RTindex),data,size);
+    VUnlock();
     
-    return RTpointer;
+    return RTindex;
 }
 
 
 
-void VFree(addrs_t* addr){
+void VFree(handle_t addr){
+    if (VLock())
+        return;
     //Checks for failures
-    if (addr >= tableEndPointer || *addr == NULL){
+    if (addr == 0 || addr >= tableEnd || RT[addr] == 0){
+#ifdef HEAP_DEBUG
+        heapCorruption(addr && addr < tableEnd ? "double VFree" : "VFree of a handle never handed out", addr);
+#endif
         reqfailCount++;
+        VUnlock();
         return;
     }
     
-    /*Find the size of what you're taking out and set up the values need for a while loop to check for coalescing to the heap to maintain one contiguous block */
-    unsigned int temp;
-    addrs_t Heap = *addr;
-    size_t size = (*(unsigned int *)((char *)(Heap) - 4))& ~0x7;
-    size_t addon = 8;
-    addrs_t* TableIndex = &RT;
+    /*Find the size of what you're taking out. Every block after it slides down by the size of the freed block to keep the heap one contiguous block */
+    size_t freedOffset = RT[addr];
+    addrs_t Heap = blockHeader(basePointer + freedOffset);
+    size_t size = (*(unsigned int *)Heap)& ~0x7;
+    addrs_t nextBlock = Heap + size + 8;
+    handle_t TableIndex;
+    
+    if (Heap + 4 != basePointer + freedOffset) //the block came from VMallocAligned.
+        alignedBlocks--;
+#ifdef HEAP_DEBUG
+    if (Heap + size + 8 > curPointer || *(unsigned int *)(Heap + size + 4) != *(unsigned int *)Heap)
+        heapCorruption("header and footer disagree", addr);
+    if (*(uint64_t *)(Heap + 4 + size - CANARY_SIZE) != CANARY_OF(addr))
+        heapCorruption("write past the end of a block", addr);
+#endif
+    
+    memmove(Heap, nextBlock, curPointer - nextBlock); //headers, data and footers all move together.
     curPointer -=  (size + 8); //update curPointer accordingly
-    addrs_t index;
-    
-    
-    /*Goes through the table to find if what any address the table pointers point to are the next one after what's removed, for proper coalescing */
-    while ( TableIndex < tableEndPointer){
-        index = *TableIndex;
-        if (index == size + addon + Heap){ //if we found a block after the freed block to be moved.
-            temp = (*(unsigned  int *)index);
-            size_t cursize = (*(unsigned int *)((char *)(index) - 4))& ~0x7;
-            addon += cursize; //+ 8;
-            index -= (size + 8);
-            *(index - 4)  = cursize;
-            *(index + cursize)= cursize;
-            *index = (unsigned int*) temp;
-            *TableIndex = index;
-            
-            TableIndex = &RT;
-        }
-        else { //if we did not find a block after the free block yet.
-            TableIndex = (addrs_t*) (((char*)TableIndex) + sizeof(addrs_t*));
+#ifdef HEAP_DEBUG
+    memset(curPointer, POISON_BYTE, size + 8); //stale addresses into the vacated end of the heap now read 0xdd.
+#endif
+    
+    /*Every table entry past the freed block now refers to data (size + 8) bytes lower. Aligned blocks may need their data nudged back onto their alignment. */
+    for (TableIndex = 1; TableIndex < tableEnd; TableIndex++){
+        if (RT[TableIndex] > freedOffset){
+            RT[TableIndex] -= (size + 8);
+            if (alignedBlocks && (*(unsigned int *)(basePointer + RT[TableIndex] - 4) & 2)){
+                addrs_t data = basePointer + RT[TableIndex];
+                RT[TableIndex] = alignData(blockHeader(data), data, *(unsigned int *)(data - 4) & ~0x7);
+                armBlock(TableIndex);
+            }
         }
     }
     
+    RT[addr] = 0; //free the internal entry in the redirection table.
+    if (liveSampleCount) //VFree is already linear in the table, so a probe costs nothing worth flagging blocks for.
+        dropSample(addr);
+    while (tableEnd > 1 && RT[tableEnd - 1] == 0){ //pull the end of the table back over unused entries.
+        tableEnd--;
+    }
+    
     /*update static heapchecker variables*/
     allocatedBlocks--;
     rawTotalAllocated -= size;
@@ -254,34 +843,296 @@ void VFree(addrs_t* addr){
     rawTotalFree += size;
     paddedTotalFree += size + 8;
     freeCount++;
+    publishState();
+    VUnlock();
+}
+
+
+void VGet(any_t return_data, handle_t addr, size_t size){
+    /*Copies the data of the block addr refers to into return_data, up to size bytes, then frees addr */
     
-    *addr = NULL; //free the internal entry in the redirection table.
+    if (VLock()) //the block must not slide between the copy and the VFree.
+        return;
+    if (addr && addr < tableEnd && RT[addr]){
+        size_t cursize = dataSize(VADDR(addr));
+        memcpy(return_data, VADDR(addr), size < cursize ? size : cursize);
+    }
+    VFree(addr); //counts the failure for a bad handle.
+    VUnlock();
 }
 
+handle_t VPutV(const struct iovec* iov, int iovcnt){
+    /* VPut for data in several pieces. One block holds all of them back to back. */
+    size_t total = 0;
+    addrs_t next;
+    handle_t RTindex;
+    int i;
+    
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    if (VLock())
+        return 0;
+    RTindex = VMalloc(total);
+    if (RTindex == 0){
+        VUnlock();
+        return 0;
+    }
+    for (i = 0, next = VADDR(RTindex); i < iovcnt; next += iov[i].iov_len, i++)
+        memcpy(next, iov[i].iov_base, iov[i].iov_len);
+    VUnlock();
+    
+    return RTindex;
+}
 
-void VGet(any_t return_data, addrs_t* addr, size_t size){
-    /*Sets return_data to the data at *(*(addr)) then frees addr */
+size_t VGetV(const struct iovec* iov, int iovcnt, handle_t addr){
+    /* VGet into several buffers, filled in turn. Returns the number of bytes copied, which includes up to 7 bytes
+     of padding after the data that was put in, as blocks only keep their size rounded up to ALIGNMENT. */
+    size_t left = 0, n, copied = 0;
+    int i;
     
-    addrs_t Heap = *addr;
-    unsigned int temp = (*(unsigned int *)Heap);
-    size_t cursize = (*(unsigned int *)((char *)(Heap) - 4))& ~0x7;
-    addrs_t TableIndex = &RT;
-    addrs_t index;
+    if (VLock())
+        return 0;
+    if (addr && addr < tableEnd && RT[addr])
+        left = dataSize(VADDR(addr));
+    for (i = 0; i < iovcnt && left; i++){
+        n = iov[i].iov_len < left ? iov[i].iov_len : left;
+        memcpy(iov[i].iov_base, VADDR(addr) + copied, n);
+        copied += n;
+        left -= n;
+    }
     VFree(addr);
-    while( size > cursize && TableIndex < tableEndPointer){
-        index = *TableIndex;
-        if (Heap == index){
-            cursize += (*(unsigned int *)((char *)(index) - 4))& ~0x7;
-            temp += (*(unsigned int *)index);
-            VFree(TableIndex);
-            TableIndex = &RT;
+    VUnlock();
+    return copied;
+}
+
+
+int VerifyHeap(void){
+    /*
+     walk the heap once and check that every header matches its footer and the blocks end exactly at curPointer,
+     then that every handle in use refers to the data of a block, with exactly one handle per block and aligned
+     data on its alignment. In a HEAP_DEBUG build the canary at the end of every block is checked as well.
+     Blocks start on every 8th byte from basePointer + 4, so the block starts and the blocks with a handle are
+     marked in two bitmaps of our own, and the heap is only read. Prints each problem and returns how many were
+     found, or -1 if there was no memory for the bitmaps or the heap was left unusable.
+     */
+    int problems = 0;
+    size_t words = memSize/(8*64) + 1, size, bit;
+    uint64_t* starts;
+    uint64_t* owned;
+    addrs_t block, walkEnd, data;
+    handle_t h;
+    
+    starts = mmap(NULL, 2*words*sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (starts == MAP_FAILED)
+        return -1;
+    owned = starts + words;
+    
+    if (VLock()){
+        munmap(starts, 2*words*sizeof(uint64_t));
+        return -1;
+    }
+    for (block = basePointer + 4; block < curPointer; block += size + 8){
+        size = (*(unsigned int *)block) & ~0x7; //0 for VMalloc(0): just a header and a footer.
+        if (block + size + 8 > curPointer){
+            fprintf(stderr, "VerifyHeap: block at offset %ld runs past curPointer\n", (long) (block - basePointer));
+            problems++;
+            break;
         }
-        else{
-            TableIndex += sizeof(addrs_t);
+        if (*(unsigned int *)(block + size + 4) != *(unsigned int *)block){
+            fprintf(stderr, "VerifyHeap: header and footer of block at offset %ld disagree\n", (long) (block - basePointer));
+            problems++;
         }
+        bit = (block - basePointer - 4)/8;
+        starts[bit/64] |= (uint64_t) 1 << (bit % 64);
     }
+    walkEnd = block;
     
-    *((unsigned int * )return_data) = (unsigned int*)temp; //copies the data to the return_data.
+    for (h = 1; h < tableEnd; h++){
+        if (RT[h] == 0)
+            continue;
+        data = basePointer + RT[h];
+        if (data < basePointer + 8 || data >= walkEnd || ((uintptr_t) data & (ALIGNMENT - 1))){
+            fprintf(stderr, "VerifyHeap: handle %zu points outside the heap\n", h);
+            problems++;
+            continue;
+        }
+        block = blockHeader(data);
+        bit = (block - basePointer - 4)/8;
+        if (block < basePointer + 4 || block >= data || (block - basePointer - 4) % 8 || !(starts[bit/64] & ((uint64_t) 1 << (bit % 64)))){
+            fprintf(stderr, "VerifyHeap: handle %zu does not point at the data of a block\n", h);
+            problems++;
+            continue;
+        }
+        if (owned[bit/64] & ((uint64_t) 1 << (bit % 64))){
+            fprintf(stderr, "VerifyHeap: handle %zu shares its block with another handle\n", h);
+            problems++;
+        }
+        owned[bit/64] |= (uint64_t) 1 << (bit % 64);
+        if ((*(unsigned int *)(data - 4) & 2) && ((uintptr_t) data & ((*(unsigned int *)(data - 4) & ~0x7) - 1))){
+            fprintf(stderr, "VerifyHeap: aligned data of handle %zu is off its alignment\n", h);
+            problems++;
+        }
+#ifdef HEAP_DEBUG
+        if (*(uint64_t *)(block + 4 + ((*(unsigned int *)block) & ~0x7) - CANARY_SIZE) != CANARY_OF(h)){
+            fprintf(stderr, "VerifyHeap: canary of handle %zu was overwritten\n", h);
+            problems++;
+        }
+#endif
+    }
+    
+    for (block = basePointer + 4; block < walkEnd; block += size + 8){
+        size = (*(unsigned int *)block) & ~0x7;
+        bit = (block - basePointer - 4)/8;
+        if (!(owned[bit/64] & ((uint64_t) 1 << (bit % 64)))){
+            fprintf(stderr, "VerifyHeap: block at offset %ld has no handle\n", (long) (block - basePointer));
+            problems++;
+        }
+    }
+    VUnlock();
+    munmap(starts, 2*words*sizeof(uint64_t));
+    return problems;
+}
+
+
+int DumpHeapMap(FILE* out){
+    /*
+     write a map of the heap to out as CSV: one row of offset, size, state and handle for every block and one for the
+     unused space after curPointer, then the free bytes, the fragmentation index (1 - largest free run / free bytes)
+     and a histogram of free runs by power of two size as # comments. VFree keeps the heap in one piece, so the
+     index stays 0 here; the map is mostly for seeing which handles hold the space. The heap is only locked while
+     the blocks and the table are copied out; the handles are matched to blocks and the text formatted after it is
+     unlocked. Returns 0, or -1 if there was no memory for the copy.
+     */
+    size_t capacity = memSize/8; //the smallest block is 8 bytes, VMalloc(0).
+    struct mapEntry* rows;
+    struct mapEntry* handles;
+    size_t count = 0, handleCount = 0, unused, i, lo, hi;
+    addrs_t block;
+    handle_t h;
+    
+    if (VLock())
+        return -1;
+    rows = mmap(NULL, capacity*sizeof(struct mapEntry), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    handles = mmap(NULL, tableEnd*sizeof(struct mapEntry), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (rows == MAP_FAILED || handles == MAP_FAILED){
+        VUnlock();
+        if (rows != MAP_FAILED)
+            munmap(rows, capacity*sizeof(struct mapEntry));
+        if (handles != MAP_FAILED)
+            munmap(handles, tableEnd*sizeof(struct mapEntry));
+        return -1;
+    }
+    for (block = basePointer + 4; block < curPointer; block += (*(unsigned int *)block & ~0x7) + 8){
+        rows[count].offset = block - basePointer;
+        rows[count].size = (*(unsigned int *)block & ~0x7) + 8;
+        rows[count++].handle = 0;
+    }
+    for (h = 1; h < tableEnd; h++){
+        if (RT[h] == 0)
+            continue;
+        handles[handleCount].offset = blockHeader(basePointer + RT[h]) - basePointer;
+        handles[handleCount++].handle = h;
+    }
+    unused = memSize - (curPointer - basePointer);
+    VUnlock();
+    
+    for (i = 0; i < handleCount; i++){ //the rows are in address order, so find each handle's block by bisection.
+        lo = 0;
+        hi = count;
+        while (lo < hi){
+            size_t mid = (lo + hi)/2;
+            if (rows[mid].offset < handles[i].offset)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo < count && rows[lo].offset == handles[i].offset)
+            rows[lo].handle = handles[i].handle;
+    }
+    
+    fprintf(out, "offset,size,state,handle\n");
+    for (i = 0; i < count; i++){
+        if (rows[i].handle)
+            fprintf(out, "%zu,%zu,alloc,%zu\n", rows[i].offset, rows[i].size, rows[i].handle);
+        else
+            fprintf(out, "%zu,%zu,alloc,\n", rows[i].offset, rows[i].size);
+    }
+    fprintf(out, "%zu,%zu,unused,\n", count ? rows[count - 1].offset + rows[count - 1].size : (size_t) 4, unused);
+    fprintf(out, "# free bytes %zu in %d runs, largest run %zu\n", unused, unused > 0, unused);
+    fprintf(out, "# fragmentation index %.4f\n", 0.0);
+    if (unused)
+        fprintf(out, "# free runs of %zu-%zu bytes: 1\n", (size_t) 1 << (63 - __builtin_clzll(unused)), ((size_t) 2 << (63 - __builtin_clzll(unused))) - 1);
+    
+    munmap(rows, capacity*sizeof(struct mapEntry));
+    munmap(handles, tableEnd*sizeof(struct mapEntry));
+    return 0;
+}
+
+
+void SetSampleRate(size_t bytes){
+    /* start sampling about one in every bytes bytes VMalloc'd, or stop with 0. the cumulative totals are kept. */
+    if (bytes){
+        void* prime[1];
+        sampling = 1;
+        backtrace(prime, 1); //the first backtrace() loads the unwinder, which allocates. get that out of the way here.
+        sampling = 0;
+    }
+    if (VLock())
+        return;
+    sampleRate = bytes;
+    sampleCountdown = nextSampleInterval();
+    VUnlock();
+}
+
+int DumpHeapProfile(FILE* out){
+    /*
+     write the sampled allocations to out as a legacy pprof heap profile: a total line, then one line per call
+     stack with the objects and bytes still in use, the objects and bytes allocated since profiling started in
+     brackets, and the return addresses. The counts are of samples only; the heap_v2/rate in the first line tells
+     pprof how to scale them up. /proc/self/maps follows so pprof can find the symbols. The sites are copied out
+     under the lock and formatted after. Returns 0, or -1 if there was no memory for the copy.
+     */
+    struct sampleSite* sites;
+    struct sampleSite total = {0};
+    size_t count = 0, i;
+    char buffer[4096];
+    ssize_t n;
+    int fd, j;
+    
+    sites = mmap(NULL, sizeof(sampleSites), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (sites == MAP_FAILED)
+        return -1;
+    if (VLock())
+        return -1;
+    for (i = 0; i < SAMPLE_SITES; i++)
+        if (sampleSites[i].hash)
+            sites[count++] = sampleSites[i];
+    VUnlock();
+    
+    for (i = 0; i < count; i++){
+        total.inuseObjects += sites[i].inuseObjects;
+        total.inuseBytes += sites[i].inuseBytes;
+        total.allocObjects += sites[i].allocObjects;
+        total.allocBytes += sites[i].allocBytes;
+    }
+    fprintf(out, "heap profile: %ld: %ld [%ld: %ld] @ heap_v2/%zu\n", total.inuseObjects, total.inuseBytes,
+            total.allocObjects, total.allocBytes, sampleRate);
+    for (i = 0; i < count; i++){
+        fprintf(out, "%ld: %ld [%ld: %ld] @", sites[i].inuseObjects, sites[i].inuseBytes, sites[i].allocObjects, sites[i].allocBytes);
+        for (j = 0; j < sites[i].depth; j++)
+            fprintf(out, " %p", sites[i].stack[j]);
+        fprintf(out, "\n");
+    }
+    munmap(sites, sizeof(sampleSites));
+    
+    fprintf(out, "\nMAPPED_LIBRARIES:\n");
+    fd = open("/proc/self/maps", O_RDONLY);
+    if (fd >= 0){
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+            fwrite(buffer, 1, n, out);
+        close(fd);
+    }
+    return 0;
 }
 
 
@@ -314,7 +1165,7 @@ void PrintAddrs(void){
     printf("Base = %p\n", basePointer);
     printf("Cur = %p\n",curPointer);
     printf("RT is %p\n",RT);
-    printf("tableend Pointer is %p\n",tableEndPointer);
+    printf("table end is %zu\n",tableEnd);
     
 }
 
@@ -339,9 +1190,8 @@ void print_testResult(int code){
 int test_stability(int numIterations, unsigned long* tot_alloc_time, unsigned long* tot_free_time){
     int i, n, res = 0;
     char s[80];
-    addrs_t* addr1;
-    addrs_t* addr2;
-    char data[80];
+    handle_t addr1;
+    handle_t addr2;
     char data2[80];
     
     unsigned long start, finish;
@@ -361,17 +1211,17 @@ int test_stability(int numIterations, unsigned long* tot_alloc_time, unsigned lo
             break;
         }
         // Check aligment
-        if (((uint64_t)addr1 & (ALIGNMENT-1)) || ((uint64_t)addr2 & (ALIGNMENT-1)))
+        if (((uint64_t)VADDR(addr1) & (ALIGNMENT-1)) || ((uint64_t)VADDR(addr2) & (ALIGNMENT-1)))
             res |= ERROR_ALIGMENT;
         // Check for data consistency
         rdtsc(&start);
         VGet((any_t)data2, addr2, n+1);
         rdtsc(&finish);
         *tot_free_time += finish - start;
-        if (!strcmp(data,data2))
+        if (strcmp(s,data2))
             res |= ERROR_DATA_INCON;
         VGet((any_t)data2, addr1, n+1);
-        if (!strcmp(data,data2))
+        if (strcmp(s,data2))
             res |= ERROR_DATA_INCON;
     }
     return res;
@@ -379,7 +1229,7 @@ int test_stability(int numIterations, unsigned long* tot_alloc_time, unsigned lo
 
 int test_ff(void){
     // Round 1 - 2 consequtive allocations should be allocated after one another
-    addrs_t* v1,v2,v3,v4;
+    handle_t v1,v2,v3,v4;
     
     v1 = VMalloc(8);
     v2 = VMalloc(4);
@@ -407,10 +1257,10 @@ int test_maxNumOfAlloc(void){
     int count = 0;
     char *d = "x";
     const int testCap = 1000000;
-    addrs_t* allocs[testCap];
+    handle_t allocs[testCap];
     
     while ((allocs[count]=VPut(d,1)) && count < testCap){
-        addrs_t data = *allocs[count];
+        addrs_t data = VADDR(allocs[count]);
         if (DATA_OF(data)!='x') break;
         count++;
     }
@@ -424,7 +1274,7 @@ int test_maxNumOfAlloc(void){
 int test_maxSizeOfAlloc(int size){
     char* d = "x";
     if (!size) return 0;
-    addrs_t* v1 = VMalloc(size);
+    handle_t v1 = VMalloc(size);
     if (v1){
         return size + test_maxSizeOfAlloc(size>>1);
     }else{
@@ -432,3 +1282,319 @@ int test_maxSizeOfAlloc(int size){
     }
 }
 
+int test_image(void){
+    // Data and handles written to an image should still be there after it is closed and mapped again
+    char path[] = "/tmp/vheap_imageXXXXXX";
+    char s[] = "persisted across a restart";
+    handle_t v1, v2;
+    int err = 0;
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return ERROR_OUT_OF_MEM;
+    close(fd);
+    
+    VClose(); // Done with the heap used by the earlier tests
+    if (VInitImage(path, 1<<16)){
+        unlink(path);
+        return ERROR_OUT_OF_MEM;
+    }
+    v1 = VPut(s, sizeof(s));
+    v2 = VPut(s, sizeof(s));
+    VFree(v1); // v2 slides down into v1's place
+    VClose();
+    
+    if (VInitImage(path, 0)){
+        unlink(path);
+        return ERROR_OUT_OF_MEM;
+    }
+    if (!v2 || strcmp(VADDR(v2), s))
+        err |= ERROR_DATA_INCON;
+    if ((uint64_t)VADDR(v2) & (ALIGNMENT-1))
+        err |= ERROR_ALIGMENT;
+    VFree(v2);
+    VClose();
+    unlink(path);
+    return err;
+}
+
+int test_shared(void){
+    // A handle made in one process should reach the same data from another process attached to the heap
+    char name[32];
+    char s[] = "from the child";
+    handle_t v1;
+    int status;
+    int err = 0;
+    pid_t pid;
+    
+    snprintf(name, sizeof(name), "/vheap_test_%d", (int)getpid());
+    shm_unlink(name);
+    if (VInitShared(name, 1<<16))
+        return ERROR_OUT_OF_MEM;
+    v1 = VPut("placeholder", 12); // Make the child's block land after one we free, so it has to slide
+    
+    pid = fork();
+    if (pid == 0){
+        VClose();
+        if (VInitShared(name, 0))
+            _exit(1);
+        _exit(VPut(s, sizeof(s)) == 2 ? 0 : 1);
+    }
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+        err |= ERROR_OUT_OF_MEM;
+    
+    VFree(v1);
+    VLock();
+    if (strcmp(VADDR(2), s))
+        err |= ERROR_DATA_INCON;
+    VUnlock();
+    VFree(2);
+    
+    // A process that dies holding the lock half way through a change leaves the heap unusable, for everyone
+    v1 = VPut(s, sizeof(s));
+    printf("Expect a report of a heap left damaged by a process that died holding the lock:\n");
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0){
+        VClose();
+        if (VInitShared(name, 0) || VLock())
+            _exit(1);
+        *(unsigned int *)(VADDR(v1) + dataSize(VADDR(v1)) + CANARY_SIZE) = 0; // The footer, as a VFree cut short would leave it
+        _exit(0);
+    }
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+        err |= ERROR_OUT_OF_MEM;
+    if (VMalloc(8) || VerifyHeap() != -1 || VLock() != -1)
+        err |= ERROR_DATA_INCON;
+    VClose();
+    if (VInitShared(name, 0) == 0)
+        err |= ERROR_DATA_INCON;
+    shm_unlink(name);
+    return err;
+}
+
+int test_aligned(void){
+    // Aligned blocks should stay aligned, with their data intact, as the blocks before them are freed
+    handle_t small[10], aligned[10];
+    size_t align;
+    int i, j, err = 0;
+    
+    VInit(1<<20); // The earlier tests closed their heaps
+    for (i = 0, align = 16; align <= PAGE_SIZE; i++, align <<= 1){
+        small[i] = VPut("x", 1 + i);
+        aligned[i] = VMallocAligned(100 + i, align);
+        if (!small[i] || !aligned[i])
+            return ERROR_OUT_OF_MEM;
+        memset(VADDR(aligned[i]), 'a' + i, 100 + i);
+    }
+    
+    for (j = 0; j < i; j++){
+        VFree(small[j]);
+        for (i = 0, align = 16; align <= PAGE_SIZE; i++, align <<= 1){
+            if ((size_t)VADDR(aligned[i]) & (align-1))
+                err |= ERROR_ALIGMENT;
+            if (VADDR(aligned[i])[0] != 'a' + i || VADDR(aligned[i])[99 + i] != 'a' + i)
+                err |= ERROR_DATA_INCON;
+        }
+    }
+    for (j = 0; j < i; j++)
+        VFree(aligned[j]);
+    if (curPointer != basePointer + 4)
+        err |= ERROR_NOT_FF;
+    
+    // Sizes that would wrap when rounded up or cut to a 32 bit tag must fail, not become tiny blocks
+    if (VMalloc(SIZE_MAX) || VMalloc(0xfffffffc) || VMallocAligned(SIZE_MAX - 8, 64) || VMallocAligned(0xfffffff0, 64))
+        err |= ERROR_DATA_INCON;
+    if (VerifyHeap() || curPointer != basePointer + 4)
+        err |= ERROR_NOT_FF;
+    VClose();
+    return err;
+}
+
+int test_verify(void){
+    // VerifyHeap should pass a heap in use without changing it, then catch a stray write over a footer and two handles to one block
+    handle_t h[8];
+    unsigned int saved;
+    size_t savedOffset;
+    char* copy;
+    int i, err = 0;
+    
+    VInit(1<<20);
+    for (i = 0; i < 8; i++){
+        h[i] = (i % 3) ? VMallocAligned(40 + i, 64) : VPut("verify", 7);
+        if (!h[i])
+            return ERROR_OUT_OF_MEM;
+    }
+    VFree(h[2]);
+    VFree(h[5]);
+    copy = malloc(curPointer - basePointer);
+    if (!copy)
+        return ERROR_OUT_OF_MEM;
+    memcpy(copy, basePointer, curPointer - basePointer);
+    if (VerifyHeap() || memcmp(copy, basePointer, curPointer - basePointer)) // It only reads the heap
+        err |= ERROR_DATA_INCON;
+    free(copy);
+    
+    printf("Expect reports of a damaged footer and a shared block from VerifyHeap:\n");
+    addrs_t footer = VADDR(h[0]) + dataSize(VADDR(h[0])) + CANARY_SIZE;
+    saved = *(unsigned int *)footer;
+    *(unsigned int *)footer = 0; // Overwrite the footer, as a stray write would
+    if (!VerifyHeap())
+        err |= ERROR_DATA_INCON;
+    *(unsigned int *)footer = saved;
+    
+    savedOffset = RT[h[4]];
+    RT[h[4]] = RT[h[3]];
+    if (!VerifyHeap())
+        err |= ERROR_DATA_INCON;
+    RT[h[4]] = savedOffset;
+    
+    for (i = 0; i < 8; i++)
+        if (i != 2 && i != 5)
+            VFree(h[i]);
+    if (VerifyHeap() || curPointer != basePointer + 4)
+        err |= ERROR_NOT_FF;
+    VClose();
+    
+    // VMalloc(0) makes blocks of just a header and a footer, and a heap full of them is fine
+    VInit(1<<16);
+    for (i = 0; i < 8191 && VMalloc(0); i++)
+        ;
+    if (i == 0 || VerifyHeap())
+        err |= ERROR_DATA_INCON;
+    VClose();
+    return err;
+}
+
+int test_iovec(void){
+    // A frame put together from pieces should come back whole, and VGet should copy all of one block and no more
+    char head[6] = "head:", body[3000], tail[6] = ":tail";
+    char out1[4], out2[3005], out3[20];
+    struct iovec in[3] = {{head, 5}, {body, sizeof(body)}, {tail, 5}};
+    struct iovec out[3] = {{out1, sizeof(out1)}, {out2, sizeof(out2)}, {out3, sizeof(out3)}};
+    handle_t v1, v2;
+    size_t copied;
+    int err = 0;
+    
+    VInit(1<<20);
+    memset(body, 'b', sizeof(body));
+    v1 = VPutV(in, 3);
+    v2 = VPut("after", 6);
+    if (!v1 || !v2)
+        return ERROR_OUT_OF_MEM;
+    if (memcmp(VADDR(v1), "head:", 5) || VADDR(v1)[5] != 'b' || VADDR(v1)[3004] != 'b' || memcmp(VADDR(v1) + 3005, ":tail", 5))
+        err |= ERROR_DATA_INCON;
+    
+    memset(out3, 0, sizeof(out3));
+    copied = VGetV(out, 3, v1);
+    if (copied < 3010 || copied > 3010 + 7 || out3[copied - 3009]) // The 3010 bytes put in, their padding and no more
+        err |= ERROR_DATA_INCON;
+    if (memcmp(out1, "head", 4) || out2[0] != ':' || out2[3000] != 'b' || memcmp(out2 + 3001, ":tai", 4) || out3[0] != 'l')
+        err |= ERROR_DATA_INCON;
+    
+    memset(out2, 0, sizeof(out2));
+    v1 = VPut(body, 1000);
+    VGet(out2, v1, sizeof(out2)); // Asking for more than the block holds must not touch the blocks after it
+    if (out2[999] != 'b' || out2[1000] || strcmp(VADDR(v2), "after") || VerifyHeap())
+        err |= ERROR_DATA_INCON;
+    
+    VGet(out2, v2, 2);
+    if (memcmp(out2, "af", 2) || out2[2] != 'b' || curPointer != basePointer + 4)
+        err |= ERROR_NOT_FF;
+    VClose();
+    return err;
+}
+
+int test_heapmap(void){
+    // Every block in the map should carry the handle that refers to it, whatever order the table is in
+    handle_t v[6];
+    char line[128];
+    size_t offset, size, handle, next;
+    FILE* map;
+    int i, rows = 0, err = 0;
+    
+    VInit(1<<20);
+    for (i = 0; i < 6; i++)
+        if (!(v[i] = VMalloc(24 + 8*i)))
+            return ERROR_OUT_OF_MEM;
+    VFree(v[1]); // the next VMalloc reuses handle 2 for a block at the end of the heap
+    v[1] = VMallocAligned(100, 64);
+    
+    map = tmpfile();
+    if (!map || DumpHeapMap(map))
+        return ERROR_OUT_OF_MEM;
+    rewind(map);
+    while (fgets(line, sizeof(line), map)){
+        if (sscanf(line, "%zu,%zu,alloc,%zu", &offset, &size, &handle) != 3)
+            continue;
+        rows++;
+        if (handle == 0 || handle >= tableEnd || blockHeader(VADDR(handle)) != basePointer + offset)
+            err |= ERROR_DATA_INCON;
+    }
+    fclose(map);
+    if (rows != 6)
+        err |= ERROR_DATA_INCON;
+    VClose();
+
+    // A heap full of the smallest blocks there are should still fit in the map, one row each
+    VInit(1<<16);
+    for (i = 0; VMalloc(0); i++)
+        ;
+    map = tmpfile();
+    if (!map || DumpHeapMap(map))
+        return ERROR_OUT_OF_MEM;
+    rewind(map);
+    rows = 0;
+    next = 4;
+    while (fgets(line, sizeof(line), map)){
+        if (sscanf(line, "%zu,%zu,alloc,%zu", &offset, &size, &handle) != 3)
+            continue;
+        rows++;
+        if (offset != next || handle == 0 || handle >= tableEnd || blockHeader(VADDR(handle)) != basePointer + offset)
+            err |= ERROR_DATA_INCON;
+        next = offset + size;
+    }
+    fclose(map);
+    if (rows != i)
+        err |= ERROR_DATA_INCON;
+    VClose();
+    return err;
+}
+
+int test_profile(void){
+    // With a small sample rate nearly every block is sampled, and freeing them should empty the in use totals
+    handle_t v[64];
+    char line[256];
+    long int inuseObjects = -1, inuseBytes, allocObjects = -1, allocBytes;
+    FILE* profile;
+    int i, maps = 0, err = 0;
+    
+    VInit(1<<20);
+    SetSampleRate(64);
+    for (i = 0; i < 64; i++)
+        if (!(v[i] = VMalloc(1000)))
+            return ERROR_OUT_OF_MEM;
+    for (i = 0; i < 64; i += 2)
+        VFree(v[i]);
+    
+    profile = tmpfile();
+    if (!profile || DumpHeapProfile(profile))
+        return ERROR_OUT_OF_MEM;
+    rewind(profile);
+    if (!fgets(line, sizeof(line), profile) || sscanf(line, "heap profile: %ld: %ld [%ld: %ld] @ heap_v2/64", &inuseObjects, &inuseBytes, &allocObjects, &allocBytes) != 4)
+        err |= ERROR_DATA_INCON;
+    while (fgets(line, sizeof(line), profile))
+        maps |= !strcmp(line, "MAPPED_LIBRARIES:\n");
+    fclose(profile);
+    if (inuseObjects < 24 || inuseObjects > 32 || allocObjects < 50 || inuseBytes > 32*1000 || !maps)
+        err |= ERROR_DATA_INCON;
+    
+    for (i = 1; i < 64; i += 2)
+        VFree(v[i]);
+    if (liveSampleCount || VerifyHeap())
+        err |= ERROR_DATA_INCON;
+    SetSampleRate(0);
+    VClose();
+    return err;
+}